@@ -0,0 +1,198 @@
+// benchmark harness: runs every .cat script in a directory and a few compiles
+// of generated sources, each several times, and writes the timings as json.
+//
+//   bench [-n runs] [-o out.json] [dir]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "batch.hpp"
+#include "compiler.hpp"
+#include "cvm.hpp"
+#include "program.hpp"
+
+struct Result {
+    std::string name;
+    std::string kind;                // "vm" or "compile"
+    std::vector<uint64_t> times_ns;  // sorted
+    uint64_t instructions = 0;       // vm: per run
+    uint64_t source_bytes = 0;       // compile: per run
+};
+
+static uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+static std::string read_file(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("could not open file '" + path + "'");
+    }
+
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return buffer.str();
+}
+
+// compiles once, then times fresh vms on the same program. the first run only
+// warms up the caches and the nursery pages.
+static Result run_script(const std::string& path, size_t runs) {
+    Result result;
+    result.name = std::filesystem::path(path).stem().string();
+    result.kind = "vm";
+
+    ProgramRef program = make_program(Compiler(read_file(path)).compile());
+
+    for (size_t i = 0; i <= runs; i++) {
+        CVM vm(program);
+        vm.output().set_sink(std::make_shared<MemorySink>());
+
+        auto start = std::chrono::steady_clock::now();
+        vm.execute();
+        uint64_t ns = elapsed_ns(start);
+
+        if (i == 0) continue;
+        result.times_ns.push_back(ns);
+        result.instructions = vm.instructions();
+    }
+
+    std::sort(result.times_ns.begin(), result.times_ns.end());
+    return result;
+}
+
+// identifiers can only hold letters and underscores
+static std::string name_of(size_t i) {
+    std::string name = "f_";
+    for (i++; i; i /= 26) name += static_cast<char>('a' + i % 26);
+    return name;
+}
+
+// many small functions, each calling the next one, declared before their callers
+static std::string many_functions(size_t count) {
+    std::string src;
+    for (size_t i = count; i-- > 0;) {
+        src += "fn " + name_of(i) + "(int x) int {\n";
+        src += "    int y = x + " + std::to_string(i % 50) + ";\n";
+        src += "    string s = \"k" + std::to_string(i % 7) + "\";\n";
+        src += "    if y < 3 {\n        return y;\n    }\n";
+        if (i + 1 < count) src += "    return " + name_of(i + 1) + "(x - 1) + size(s);\n";
+        else src += "    return y;\n";
+        src += "}\n";
+    }
+    src += "print(" + name_of(0) + "(30));\n";
+    return src;
+}
+
+// one long top level of expression statements over a few globals
+static std::string long_top_level(size_t count) {
+    std::string src = "int base = 7;\nstring tag = \"v\";\n";
+    for (size_t i = 0; i < count; i++) {
+        std::string k = std::to_string(i);
+        src += "print(base * " + k + " + 1, tag + " + k + ", (base - " + k + ") % 13 == 0);\n";
+    }
+    return src;
+}
+
+static Result run_compile(const std::string& name, const std::string& src, size_t runs) {
+    Result result;
+    result.name = name;
+    result.kind = "compile";
+    result.source_bytes = src.size();
+
+    for (size_t i = 0; i <= runs; i++) {
+        auto start = std::chrono::steady_clock::now();
+        Module module = Compiler(src).compile();
+        uint64_t ns = elapsed_ns(start);
+
+        if (i == 0) continue;
+        result.times_ns.push_back(ns);
+    }
+
+    std::sort(result.times_ns.begin(), result.times_ns.end());
+    return result;
+}
+
+static std::string to_json(const std::vector<Result>& results, size_t runs) {
+    std::ostringstream out;
+    out << "{\n  \"runs\": " << runs << ",\n  \"benchmarks\": [\n";
+
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        uint64_t median = percentile(r.times_ns, 0.50);
+        double seconds = median / 1e9;
+
+        out << "    {\"name\": \"" << r.name << "\", \"kind\": \"" << r.kind << "\", "
+            << "\"median_ns\": " << median << ", "
+            << "\"p99_ns\": " << percentile(r.times_ns, 0.99) << ", "
+            << "\"min_ns\": " << (r.times_ns.empty() ? 0 : r.times_ns.front()) << ", ";
+
+        if (r.kind == "vm") {
+            out << "\"instructions\": " << r.instructions << ", "
+                << "\"instructions_per_second\": " << static_cast<uint64_t>(seconds > 0 ? r.instructions / seconds : 0);
+        } else {
+            out << "\"source_bytes\": " << r.source_bytes << ", "
+                << "\"bytes_per_second\": " << static_cast<uint64_t>(seconds > 0 ? r.source_bytes / seconds : 0);
+        }
+
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+
+    out << "  ]\n}\n";
+    return out.str();
+}
+
+int main(int argc, char* argv[]) {
+    size_t runs = 10;
+    std::string out_path;
+    std::string dir = "bench";
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-n" && i + 1 < argc) runs = std::max<size_t>(1, std::stoul(argv[++i]));
+        else if (arg == "-o" && i + 1 < argc) out_path = argv[++i];
+        else if (arg == "-h") {
+            std::cout << "Usage: " << argv[0] << " [-n runs] [-o out.json] [dir]\n";
+            return 0;
+        }
+        else dir = arg;
+    }
+
+    std::vector<std::string> scripts;
+    for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+        if (entry.is_regular_file() && entry.path().extension() == ".cat") scripts.push_back(entry.path().string());
+    }
+    std::sort(scripts.begin(), scripts.end());
+
+    std::vector<Result> results;
+    try {
+        for (const auto& path : scripts) {
+            std::cerr << "bench: " << path << "\n";
+            results.push_back(run_script(path, runs));
+        }
+
+        std::cerr << "bench: compile\n";
+        results.push_back(run_compile("compile_functions", many_functions(4000), runs));
+        results.push_back(run_compile("compile_top_level", long_top_level(20000), runs));
+    } catch (const std::exception& e) {
+        std::cerr << "bench: error: " << e.what() << "\n";
+        return 1;
+    }
+
+    std::string json = to_json(results, runs);
+    if (out_path.empty()) {
+        std::cout << json;
+        return 0;
+    }
+
+    std::ofstream file(out_path);
+    file << json;
+    std::cerr << "bench: wrote " << out_path << "\n";
+    return 0;
+}
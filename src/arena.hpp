@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <functional>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// bump allocator for memory that lives exactly as long as one compilation.
+// allocation is a pointer bump, individual frees are no-ops and reset() drops
+// everything at once. default sized blocks go back to a small per-thread cache
+// so back to back compilations don't touch malloc at all.
+class Arena {
+private:
+    struct Block {
+        Block* next;
+        size_t size;
+    };
+
+    static const size_t BLOCK_SIZE = 64 * 1024;
+    static const size_t MAX_SPARE  = 8;
+
+    Block* head = nullptr;
+    char*  cur = nullptr;
+    char*  end = nullptr;
+    size_t used = 0;
+
+    struct SpareBlocks {
+        Block* list = nullptr;
+        size_t count = 0;
+
+        ~SpareBlocks() {
+            while (list) {
+                Block* next = list->next;
+                std::free(list);
+                list = next;
+            }
+        }
+    };
+
+    static SpareBlocks& spare() {
+        thread_local SpareBlocks blocks;
+        return blocks;
+    }
+
+    static char* data(Block* b) {
+        return reinterpret_cast<char*>(b) + sizeof(Block);
+    }
+
+    void grow(size_t min_size) {
+        size_t size = min_size > BLOCK_SIZE - sizeof(Block) ? min_size + sizeof(Block) : BLOCK_SIZE;
+        Block* b = nullptr;
+
+        SpareBlocks& sp = spare();
+        if (size == BLOCK_SIZE && sp.list) {
+            b = sp.list;
+            sp.list = b->next;
+            sp.count--;
+        } else {
+            b = static_cast<Block*>(std::malloc(size));
+            if (!b) throw std::bad_alloc();
+            b->size = size;
+        }
+
+        b->next = head;
+        head = b;
+        cur = data(b);
+        end = reinterpret_cast<char*>(b) + size;
+    }
+
+public:
+    Arena() = default;
+    ~Arena() { reset(); }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* alloc(size_t size, size_t align = alignof(std::max_align_t)) {
+        uintptr_t p = (reinterpret_cast<uintptr_t>(cur) + align - 1) & ~(uintptr_t)(align - 1);
+        if (!cur || p + size > reinterpret_cast<uintptr_t>(end)) {
+            grow(size + align);
+            p = (reinterpret_cast<uintptr_t>(cur) + align - 1) & ~(uintptr_t)(align - 1);
+        }
+
+        cur = reinterpret_cast<char*>(p + size);
+        used += size;
+        return reinterpret_cast<void*>(p);
+    }
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        return new (alloc(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    std::string_view copy(std::string_view s) {
+        if (s.empty()) return std::string_view();
+        char* p = static_cast<char*>(alloc(s.size(), 1));
+        std::memcpy(p, s.data(), s.size());
+        return std::string_view(p, s.size());
+    }
+
+    // releases every allocation at once, nothing allocated from this arena may be used afterwards
+    void reset() {
+        SpareBlocks& sp = spare();
+        while (head) {
+            Block* next = head->next;
+            if (head->size == BLOCK_SIZE && sp.count < MAX_SPARE) {
+                head->next = sp.list;
+                sp.list = head;
+                sp.count++;
+            } else {
+                std::free(head);
+            }
+            head = next;
+        }
+
+        cur = end = nullptr;
+        used = 0;
+    }
+
+    size_t bytes_used() const { return used; }
+};
+
+// lets standard containers draw from an arena, deallocate is a no-op
+template <typename T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+
+    Arena* arena;
+
+    explicit ArenaAllocator(Arena& a) : arena(&a) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(arena->alloc(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T*, size_t) {}
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+};
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+template <typename V>
+using ArenaMap = std::unordered_map<std::string_view, V, std::hash<std::string_view>, std::equal_to<std::string_view>,
+                                    ArenaAllocator<std::pair<const std::string_view, V>>>;
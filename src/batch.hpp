@@ -0,0 +1,282 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cache.hpp"
+#include "compiler.hpp"
+#include "cvm.hpp"
+#include "program.hpp"
+
+// the nearest rank percentile p (0 to 1) of sorted, 0 when it is empty
+inline uint64_t percentile(const std::vector<uint64_t>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+    return sorted[std::min(sorted.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+struct BatchOptions {
+    size_t     workers = 0;       // 0 = one per hardware thread
+    bool       use_cache = true;  // compiled modules go through ModuleCache
+    HeapConfig heap;
+    NativeRegistryRef natives;    // host functions the scripts may call
+    uint64_t   quota = 0;         // fuel a script may burn in total, 0 = no limit
+    uint64_t   slice = 0;         // fuel per turn when scripts share a worker, 0 = run each to the end
+    size_t     max_output = 16 << 20;  // bytes a script may print before it fails, 0 = no limit
+};
+
+struct BatchResult {
+    std::string path;
+    std::string output;           // everything the script printed
+    std::string error;            // runtime error report, empty when it ran cleanly
+    bool        ok = false;
+    uint64_t    latency_ns = 0;   // read, compile and run, with the turns other scripts got in between
+};
+
+struct BatchReport {
+    std::vector<BatchResult> results;  // in the order the scripts were given
+    size_t   failed = 0;
+    double   wall_seconds = 0;
+    double   throughput = 0;           // scripts per second
+    uint64_t p50_ns = 0;
+    uint64_t p90_ns = 0;
+    uint64_t p99_ns = 0;
+    uint64_t max_ns = 0;
+};
+
+// runs independent scripts on a pool of worker threads. every worker has its own
+// deque of script indices, it pops from the back of its own and once that runs
+// dry steals from the front of the others'. all work is queued up front, so a
+// worker that finds every deque empty is done. each script gets its own vm and
+// heap; a worker's nursery and pool pages are recycled between its scripts by
+// the thread local caches in heap.hpp and pool.hpp. with a slice set a worker
+// keeps a few scripts going at once and runs them round robin, each turn
+// worth slice units of fuel, so a long script cannot hold up the short ones
+// queued behind it.
+class BatchExecutor {
+private:
+    static const size_t MAX_LIVE = 8;  // scripts one worker interleaves
+
+    struct WorkQueue {
+        std::mutex         lock;
+        std::deque<size_t> items;
+    };
+
+    // a script that has started and not finished
+    struct Running {
+        size_t                      item;
+        std::unique_ptr<CVM>        vm;
+        std::shared_ptr<MemorySink> output;
+        std::shared_ptr<MemorySink> errors;
+        std::chrono::steady_clock::time_point start;
+        uint64_t                    spent = 0;  // fuel burnt so far
+    };
+
+    BatchOptions                            opts;
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+
+    bool pop(size_t worker, size_t& item) {
+        WorkQueue& q = *queues[worker];
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (q.items.empty()) return false;
+
+        item = q.items.back();
+        q.items.pop_back();
+        return true;
+    }
+
+    bool steal(size_t thief, size_t& item) {
+        for (size_t i = 1; i < queues.size(); i++) {
+            WorkQueue& q = *queues[(thief + i) % queues.size()];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (q.items.empty()) continue;
+
+            item = q.items.front();
+            q.items.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    Module load(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            throw std::runtime_error("could not open file '" + path + "'");
+        }
+
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        std::string content = buffer.str();
+
+        Module module;
+        std::vector<uint8_t> raw(content.begin(), content.end());
+        if (ModuleReader::is_module(raw)) {
+            module = ModuleReader(raw).read();
+        } else {
+            ModuleCache cache;
+            uint64_t natives = opts.natives ? opts.natives->signature() : 0;
+            if (!opts.use_cache || !cache.load(content, module, natives)) {
+                Compiler compiler(content, opts.natives.get());
+                compiler.set_threads(1);  // the other workers are compiling too
+                module = compiler.compile();
+                module.source_hash = fnv1a(content);
+                if (opts.use_cache) cache.store(content, module, natives);
+            }
+        }
+
+        module.source_name = path;
+        return module;
+    }
+
+    static void fail(Running& r, const std::exception& e) {
+        r.errors->write("error: ", 7);
+        r.errors->write(e.what(), std::strlen(e.what()));
+        r.errors->write("\n", 1);
+    }
+
+    void finish(BatchResult& result, Running& r) {
+        // drop the vm first so its output is flushed
+        r.vm.reset();
+        result.output = r.output->contents();
+        result.error = r.errors->contents();
+        result.latency_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - r.start).count();
+    }
+
+    // loads and compiles the script, false when that already failed
+    bool start(BatchResult& result, Running& r) {
+        r.start = std::chrono::steady_clock::now();
+        r.output = std::make_shared<MemorySink>();
+        r.errors = std::make_shared<MemorySink>();
+
+        try {
+            r.vm = std::make_unique<CVM>(make_program(load(result.path)), false, opts.heap);
+            r.vm->output().set_sink(r.output);
+            r.vm->output().set_policy(FlushPolicy::HALT);
+            r.vm->output().set_limit(opts.max_output);
+            r.vm->set_diagnostics(r.errors);
+            r.vm->set_parallelism(1);  // the batch already keeps every core busy
+            r.vm->set_natives(opts.natives);
+            // scripts in a batch are independent, one must never read another's messages
+            r.vm->set_channels(std::make_shared<ChannelHub>());
+            return true;
+        } catch (const std::exception& e) {
+            fail(r, e);
+            finish(result, r);
+            return false;
+        }
+    }
+
+    // runs one turn of the script, true once it is done
+    bool step(BatchResult& result, Running& r) {
+        try {
+            uint64_t budget = opts.slice ? opts.slice : CVM::UNLIMITED;
+            if (opts.quota) budget = std::min(budget, opts.quota - r.spent);
+
+            r.vm->set_fuel(budget);
+            bool done = r.vm->execute();
+            if (budget != CVM::UNLIMITED) r.spent += budget - r.vm->fuel_left();
+
+            if (!done) {
+                if (!opts.quota || r.spent < opts.quota) return false;
+                throw std::runtime_error("fuel quota of " + std::to_string(opts.quota) + " exhausted.");
+            }
+            result.ok = true;
+        } catch (const std::exception& e) {
+            fail(r, e);
+        }
+
+        finish(result, r);
+        return true;
+    }
+
+    void worker(size_t id, std::vector<BatchResult>& results) {
+        size_t window = opts.slice ? MAX_LIVE : 1;
+        std::deque<Running> live;
+        size_t item;
+
+        for (;;) {
+            while (live.size() < window && (pop(id, item) || steal(id, item))) {
+                Running r;
+                r.item = item;
+                if (start(results[item], r)) live.push_back(std::move(r));
+            }
+            if (live.empty()) return;
+
+            Running r = std::move(live.front());
+            live.pop_front();
+            if (!step(results[r.item], r)) live.push_back(std::move(r));
+        }
+    }
+
+public:
+    explicit BatchExecutor(const BatchOptions& options = BatchOptions()) : opts(options) {
+        if (opts.workers == 0) opts.workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    BatchReport run(const std::vector<std::string>& paths) {
+        BatchReport report;
+        report.results.resize(paths.size());
+        for (size_t i = 0; i < paths.size(); i++) report.results[i].path = paths[i];
+
+        size_t workers = std::max<size_t>(1, std::min(opts.workers, paths.size()));
+        queues.clear();
+        for (size_t i = 0; i < workers; i++) queues.push_back(std::make_unique<WorkQueue>());
+
+        // contiguous slices keep neighbouring scripts on one worker until it is stolen from
+        for (size_t i = 0; i < paths.size(); i++) {
+            queues[i * workers / paths.size()]->items.push_back(i);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < workers; i++) {
+            threads.emplace_back(&BatchExecutor::worker, this, i, std::ref(report.results));
+        }
+        worker(0, report.results);
+        for (auto& t : threads) t.join();
+
+        report.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::vector<uint64_t> latencies;
+        for (const auto& r : report.results) {
+            latencies.push_back(r.latency_ns);
+            if (!r.ok) report.failed++;
+        }
+        std::sort(latencies.begin(), latencies.end());
+
+        report.throughput = report.wall_seconds > 0 ? paths.size() / report.wall_seconds : 0;
+        report.p50_ns = percentile(latencies, 0.50);
+        report.p90_ns = percentile(latencies, 0.90);
+        report.p99_ns = percentile(latencies, 0.99);
+        report.max_ns = latencies.empty() ? 0 : latencies.back();
+        return report;
+    }
+
+    // every .cat and .catc file under dir, sorted
+    static std::vector<std::string> collect(const std::string& dir) {
+        std::vector<std::string> paths;
+        for (const auto& entry : std::filesystem::recursive_directory_iterator(dir)) {
+            if (!entry.is_regular_file()) continue;
+
+            std::string ext = entry.path().extension().string();
+            if (ext == ".cat" || ext == ".catc") paths.push_back(entry.path().string());
+        }
+
+        std::sort(paths.begin(), paths.end());
+        return paths;
+    }
+};
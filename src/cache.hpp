@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+
+#include "module.hpp"
+
+// on-disk compile cache, modules are keyed by the fnv1a hash of their source, the
+// bytecode revision and, when they were compiled against host functions, the
+// registry's signature.
+// the cache is best effort: unreadable, stale or corrupt entries are treated as
+// misses and failed writes are ignored.
+class ModuleCache {
+private:
+    std::filesystem::path dir;
+
+    std::filesystem::path entry(uint64_t hash, uint64_t natives) const {
+        uint8_t r[2] = {static_cast<uint8_t>(BYTECODE_REVISION), static_cast<uint8_t>(BYTECODE_REVISION >> 8)};
+        hash = fnv1a(r, sizeof(r), hash);
+
+        if (natives) {
+            uint8_t b[8];
+            for (int i = 0; i < 8; i++) b[i] = static_cast<uint8_t>(natives >> (i * 8));
+            hash = fnv1a(b, sizeof(b), hash);
+        }
+
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.catc", static_cast<unsigned long long>(hash));
+        return dir / name;
+    }
+
+public:
+    explicit ModuleCache(const std::string& d = default_dir()) : dir(d) {}
+
+    static std::string default_dir() {
+        if (const char* d = std::getenv("CVM_CACHE_DIR")) return d;
+        if (const char* d = std::getenv("XDG_CACHE_HOME")) return std::string(d) + "/cvm";
+        if (const char* d = std::getenv("HOME")) return std::string(d) + "/.cache/cvm";
+        return ".cvm_cache";
+    }
+
+    // natives is NativeRegistry::signature() of the registry the source compiles against, if any
+    bool load(const std::string& source, Module& out, uint64_t natives = 0) const {
+        uint64_t hash = fnv1a(source);
+        std::ifstream file(entry(hash, natives), std::ios::binary);
+        if (!file.is_open()) return false;
+
+        try {
+            Module module = ModuleReader::read(file);
+            if (module.source_hash != hash) return false;
+            out = std::move(module);
+            return true;
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+
+    void store(const std::string& source, const Module& module, uint64_t natives = 0) const {
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+        if (ec) return;
+
+        // write to a private temp file and rename it into place so concurrent
+        // runs and threads never observe a half written entry.
+        std::filesystem::path path = entry(fnv1a(source), natives);
+        std::filesystem::path tmp = path;
+        tmp += ".tmp" + std::to_string(::getpid()) + "." +
+               std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+
+        {
+            std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+            if (!file.is_open()) return;
+            ModuleWriter().write(module, file);
+            if (!file.good()) {
+                file.close();
+                std::filesystem::remove(tmp, ec);
+                return;
+            }
+        }
+
+        std::filesystem::rename(tmp, path, ec);
+        if (ec) std::filesystem::remove(tmp, ec);
+    }
+};
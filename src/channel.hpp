@@ -0,0 +1,206 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "ctypes.hpp"
+#include "heap.hpp"
+
+// what travels through a channel: an int, a bool or a frozen string. a message
+// owns one reference to its string.
+struct Message {
+    Type type = Type::INT;
+    union {
+        int           ivalue;
+        bool          bvalue;
+        StringObject* svalue;
+    };
+
+    Message() : ivalue(0) {}
+};
+
+inline size_t ring_capacity(size_t capacity) {
+    size_t n = 2;
+    while (n < capacity) n *= 2;
+    return n;
+}
+
+// bounded multi producer multi consumer queue (Vyukov). every cell carries a
+// sequence number that tells producers and consumers whose turn it is, so a push
+// or pop is one CAS on the shared index plus the cell's own handoff.
+template <typename T>
+class MpmcRing {
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T                   value;
+    };
+
+    std::unique_ptr<Cell[]>          cells;
+    size_t                           mask;
+    alignas(64) std::atomic<size_t> tail{0};  // next cell to fill
+    alignas(64) std::atomic<size_t> head{0};  // next cell to drain
+
+public:
+    explicit MpmcRing(size_t capacity) {
+        size_t n = ring_capacity(capacity);
+        cells.reset(new Cell[n]);
+        mask = n - 1;
+        for (size_t i = 0; i < n; i++) cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool try_push(const T& value) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[pos & mask];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;  // full
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool try_pop(T& value) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[pos & mask];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    value = cell.value;
+                    cell.seq.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;  // empty
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+// bounded single producer single consumer queue. each side owns one index and
+// keeps a cached copy of the other's, so it only touches the other side's cache
+// line when the ring looks full or empty.
+template <typename T>
+class SpscRing {
+private:
+    std::unique_ptr<T[]> slots;
+    size_t               mask;
+
+    alignas(64) std::atomic<size_t> tail{0};  // written by the producer
+    size_t                           head_cache = 0;
+    alignas(64) std::atomic<size_t> head{0};  // written by the consumer
+    size_t                           tail_cache = 0;
+
+public:
+    explicit SpscRing(size_t capacity) {
+        size_t n = ring_capacity(capacity);
+        slots.reset(new T[n]);
+        mask = n - 1;
+    }
+
+    bool try_push(const T& value) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head_cache > mask) {
+            head_cache = head.load(std::memory_order_acquire);
+            if (t - head_cache > mask) return false;
+        }
+
+        slots[t & mask] = value;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T& value) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail_cache) {
+            tail_cache = tail.load(std::memory_order_acquire);
+            if (h == tail_cache) return false;
+        }
+
+        value = slots[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+enum class ChannelKind : uint8_t {
+    MPMC,  // any number of vms on either end
+    SPSC,  // exactly one sending and one receiving vm, the host has to guarantee it
+};
+
+class Channel {
+public:
+    virtual ~Channel() = default;
+    virtual bool try_send(const Message& m) = 0;
+    virtual bool try_recv(Message& m) = 0;
+};
+
+template <typename Ring>
+class RingChannel : public Channel {
+private:
+    Ring ring;
+
+public:
+    explicit RingChannel(size_t capacity) : ring(capacity) {}
+
+    // messages nobody received still hold their strings
+    ~RingChannel() override {
+        Message m;
+        while (ring.try_pop(m)) {
+            if (m.type == Type::STRING) release_frozen(m.svalue);
+        }
+    }
+
+    bool try_send(const Message& m) override { return ring.try_push(m); }
+    bool try_recv(Message& m) override { return ring.try_pop(m); }
+};
+
+// named channels shared by the vms of one process. scripts open them by name with
+// channel(name); the host can create them up front to pick the capacity or the
+// SPSC ring, and give groups of vms separate hubs to keep them apart.
+class ChannelHub {
+private:
+    std::mutex lock;
+    std::unordered_map<std::string, std::shared_ptr<Channel>> channels;
+
+public:
+    static const size_t DEFAULT_CAPACITY = 1024;
+
+    // the existing channel with this name, or a new one
+    std::shared_ptr<Channel> open(const std::string& name, size_t capacity = DEFAULT_CAPACITY,
+                                  ChannelKind kind = ChannelKind::MPMC) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto& ch = channels[name];
+        if (!ch) {
+            if (kind == ChannelKind::SPSC) ch = std::make_shared<RingChannel<SpscRing<Message>>>(capacity);
+            else ch = std::make_shared<RingChannel<MpmcRing<Message>>>(capacity);
+        }
+        return ch;
+    }
+
+    // vms that were not given a hub share this one
+    static const std::shared_ptr<ChannelHub>& global() {
+        static const std::shared_ptr<ChannelHub> hub = std::make_shared<ChannelHub>();
+        return hub;
+    }
+};
@@ -1,57 +1,132 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <charconv>
 #include <cstddef>
 #include <cstdint>
 #include <sys/types.h>
 #include <unordered_map>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <stdexcept>
+#include <thread>
 
+#include "arena.hpp"
 #include "ctypes.hpp"
 #include "lexer.hpp"
+#include "lines.hpp"
+#include "module.hpp"
+#include "natives.hpp"
 #include "opcodes.hpp"
 
+// names are views into the compiler's arena
 struct Parameter {
-    std::string symbol;
+    std::string_view symbol;
     Type type;
 };
 
 struct Function {
-    std::string name;
+    std::string_view name;
     Type return_type;
-    std::vector<Parameter> params;
+    ArenaVector<Parameter> params;
     size_t bytecode_offset;
     size_t local_count;
+    bool pure = true;  // no print, task, file or impure native calls, and only calls pure functions
+
+    size_t id = 0;     // position in declaration order
+    size_t body = 0;   // token after the body's '{'
+    size_t end = 0;    // token after the body's '}'
+
+    explicit Function(Arena& arena) : params(ArenaAllocator<Parameter>(arena)) {}
+};
+
+struct Local {
+    size_t slot;
+    Type   type;
+    Type   element_type;
+};
+
+// the code of one function body, or of the top level, compiled on its own.
+// operands that depend on the rest of the module are left as zeros and listed
+// here so the link step can fill them in.
+struct Chunk {
+    std::vector<uint8_t> code;
+    LineTable            lines;
+    size_t               local_count = 0;
+
+    std::vector<std::pair<size_t, size_t>>                     calls;    // function offset at pos, by function id
+    std::vector<std::pair<size_t, std::string_view>>           strings;  // constant index at pos
+    std::vector<std::pair<size_t, const NativeFunction*>>      natives;  // import index at pos
+    std::vector<size_t>                                        callees;  // function ids called directly
+    std::vector<std::pair<size_t, bool>>                       parallel; // pmap (false) or parallel_for (true) targets
+
+    bool side_effects = false;
+
+    void clear() {
+        local_count = 0;
+        calls.clear();
+        strings.clear();
+        natives.clear();
+        callees.clear();
+        parallel.clear();
+        side_effects = false;
+    }
 };
 
 class Compiler {
 private:
-    std::vector<Token>   tokens;
+    // owns the tokens and every per-compilation table below, released in one shot by compile()
+    Arena                arena;
+
+    TokenList            tokens;
     size_t               current;
     std::vector<uint8_t> bytecode;
+    LineTable            lines;
+    SourcePos            pos;  // source position of the code being emitted
+
+    ArenaMap<Local>      variables;
+    size_t               var_count = 0;
 
-    std::unordered_map<std::string, size_t> variables;
-    size_t                                  var_count = 0;
+    ArenaVector<std::string_view> constants;
+    ArenaMap<size_t>              constant_index;
 
-    std::unordered_map<std::string, Function> functions;
-    Function*                                 current_function = nullptr;
-    Type                                      current_ret_type = Type::VOID;
-    bool                                      has_returned = false;
+    ArenaMap<Function>            functions;
+    ArenaVector<std::string_view> function_order;
+    const Function*               current_function = nullptr;
 
-    Token peek() const {
-        return tokens[current];
+    // the compiler that owns the tokens and the function table, this one unless
+    // it is compiling bodies for another
+    const Compiler*               unit;
+    Chunk                         chunk;
+    size_t                        threads = 0;  // for function bodies, 0 = one per core
+
+    const NativeRegistry*         natives;
+    ArenaMap<size_t>              native_index;    // import slot by name
+    std::vector<const NativeFunction*> native_imports;
+    Type                          current_ret_type = Type::VOID;
+    bool                          has_returned = false;
+
+    const Token& peek() const {
+        return unit->tokens[current];
     }
 
-    Token previous() const {
-        return tokens[current - 1];
+    const Token& previous() const {
+        return unit->tokens[current - 1];
     }
 
-    Token advance() {
+    const Token& advance() {
         if (!is_at_end()) current++;
+        at(previous());
         return previous();
     }
 
+    void at(const Token& token) {
+        pos.line = static_cast<uint32_t>(token.line);
+        pos.col = static_cast<uint32_t>(token.col);
+    }
+
     bool is_at_end() const {
         return peek().type == TokenType::EOS;
     }
@@ -70,11 +145,12 @@ private:
         return false;
     }
 
-    bool is_keyword(const std::string& w) {
+    bool is_keyword(std::string_view w) {
         return w == "int" || w == "string" || w == "bool" || w == "true" || w == "false";
     }
 
     void emitByte(uint8_t byte) {
+        lines.add(static_cast<uint32_t>(bytecode.size()), pos);
         bytecode.push_back(byte);
     }
 
@@ -84,7 +160,8 @@ private:
     }
 
     void emitConstant(int value) {
-        if (value <= 255) {
+        // PUSH uses the high bit to mark booleans, so only 0..127 fit in its byte
+        if (value >= 0 && value <= 127) {
             emitByte(static_cast<uint8_t>(OpCode::PUSH));
             emitByte(static_cast<uint8_t>(value));
         } else {
@@ -96,7 +173,7 @@ private:
         }
     }
 
-    uint8_t emitJump(OpCode inst) {
+    size_t emitJump(OpCode inst) {
         emitByte(static_cast<uint8_t>(inst));
         // 0xff placeholders for jump offset.
         emitByte(0xFF);
@@ -113,7 +190,7 @@ private:
             throw std::runtime_error("Expected '{' to start array literal.");
         }
 
-        std::string type_str = tokens[current - 6].value;
+        std::string_view type_str = unit->tokens[current - 6].value;
         Type e_type;
 
         if (type_str == "int") e_type = Type::INT;
@@ -137,12 +214,39 @@ private:
         }
     }
 
-    void array_index() {
-        std::string sym = previous().value;
+    size_t makeConstant(std::string_view value) {
+        auto it = constant_index.find(value);
+        if (it != constant_index.end()) return it->second;
+
+        if (constants.size() > 0xFFFF) {
+            throw std::runtime_error("Too many constants in one module.");
+        }
+
+        constants.push_back(value);
+        constant_index[value] = constants.size() - 1;
+        return constants.size() - 1;
+    }
+
+    Type parse_type(std::string_view name) {
+        if (name == "int") return Type::INT;
+        if (name == "bool") return Type::BOOL;
+        if (name == "string") return Type::STRING;
+        if (name == "void") return Type::VOID;
+        throw std::runtime_error("Invalid type '" + std::string(name) + "'.");
+    }
+
+    Type array_index() {
+        Token sym_tok = previous();
+        std::string_view sym = sym_tok.value;
+        auto var = variables.find(sym);
+        if (var == variables.end()) {
+            throw std::runtime_error("Undefined variable '" + std::string(sym) + "'");
+        }
 
         if (!match(TokenType::LBRACKET))
             throw std::runtime_error("Expected '[' after array name.");
 
+        // the array is addressed in its local slot, it never goes through the stack
         expression();
 
         if (!match(TokenType::RBRACKET))
@@ -150,51 +254,51 @@ private:
 
         if (match(TokenType::EQUALS)) {
             expression();
-            emitByte(static_cast<uint8_t>(OpCode::SETIDX)); // set index
-        } else {
-            emitByte(static_cast<uint8_t>(OpCode::GETIDX)); // get index
+            at(sym_tok);
+            emitBytes(static_cast<uint8_t>(OpCode::SETIDX_LOCAL), static_cast<uint8_t>(var->second.slot));
+            return var->second.type;
         }
+
+        at(sym_tok);
+        emitBytes(static_cast<uint8_t>(OpCode::GETIDX_LOCAL), static_cast<uint8_t>(var->second.slot));
+        return var->second.element_type;
     }
 
-    void function() {
+    // reads a signature after 'fn' and the body's extent, the body itself is
+    // compiled later
+    void declare_function() {
         if (!match(TokenType::IDENTIFIER)) {
             throw std::runtime_error("Expected function name after 'fn' keyword.");
         }
 
-        std::string func_name = previous().value;
+        std::string_view func_name = previous().value;
 
         if (functions.find(func_name) != functions.end()) {
-            throw std::runtime_error("Function '" + func_name + "' already declared.");
+            throw std::runtime_error("Function '" + std::string(func_name) + "' already declared.");
         }
 
         if (!match(TokenType::LPAREN)) {
             throw std::runtime_error("Expected '(' after function name.");
         }
 
-        Function func;
+        Function func(arena);
         func.name = func_name;
 
-        functions[func_name] = func;
-
         if (!check(TokenType::RPAREN)) {
             do {
                 if (!match(TokenType::TYPE)) {
                     throw std::runtime_error("Expected parameter type.");
                 }
 
-                std::string param_type = previous().value;
-                Type type;
-
-                if (param_type == "int") type = Type::INT;
-                else if (param_type == "string") type = Type::STRING;
-                else if (param_type == "bool") type = Type::BOOL;
-                else throw std::runtime_error("Invalid parameter type.");
+                std::string_view param_type = previous().value;
+                Type type = parse_type(param_type);
+                if (type == Type::VOID) throw std::runtime_error("Invalid parameter type.");
 
                 if (!match(TokenType::IDENTIFIER)) {
                     throw std::runtime_error("Expected parameter name.");
                 }
 
-                std::string param_name = previous().value;
+                std::string_view param_name = previous().value;
                 func.params.push_back({param_name, type});
             } while (match(TokenType::COMMA));
         }
@@ -207,23 +311,46 @@ private:
             throw std::runtime_error("Expected return type.");
         }
 
-        std::string return_type = previous().value;
-        if (return_type == "void") func.return_type = Type::VOID;
-        else if (return_type == "int") func.return_type = Type::INT;
-        else if (return_type == "string") func.return_type = Type::STRING;
-        else if (return_type == "bool") func.return_type = Type::BOOL;
-        else throw std::runtime_error("Invalid return type.");
-
-        func.bytecode_offset = bytecode.size();
-
-        current_function = &functions[func_name];
-        current_ret_type = func.return_type;
-        has_returned = false;
+        func.return_type = parse_type(previous().value);
 
         if (!match(TokenType::LBRACE)) {
             throw std::runtime_error("Expected '{' before function body.");
         }
 
+        func.body = current;
+        for (size_t depth = 1; depth > 0;) {
+            if (is_at_end()) throw std::runtime_error("Expected '}' after function body.");
+            if (match(TokenType::LBRACE)) depth++;
+            else if (match(TokenType::RBRACE)) depth--;
+            else advance();
+        }
+        func.end = current;
+
+        func.id = function_order.size();
+        functions.insert_or_assign(func_name, func);
+        function_order.push_back(func_name);
+    }
+
+    // first pass over the tokens: every signature goes into the function table
+    // before any code is generated, so calls may come before the declaration
+    void declarations() {
+        current = 0;
+        while (!is_at_end()) {
+            if (match(TokenType::FUNCTION)) declare_function();
+            else advance();
+        }
+        current = 0;
+    }
+
+    // compiles one function body into chunk, starting at offset 0
+    void function_body(const Function& func) {
+        current = func.body;
+        at(previous());
+
+        current_function = &func;
+        current_ret_type = func.return_type;
+        has_returned = false;
+
         emitByte(static_cast<uint8_t>(OpCode::ENTER));
         size_t locals_pos = bytecode.size();
         emitByte(0x0);
@@ -231,7 +358,7 @@ private:
         var_count = 0;
         variables.clear();
         for (const auto& param : func.params) {
-            variables[param.symbol] = var_count++;
+            variables[param.symbol] = {var_count++, param.type, Type::VOID};
         }
 
         while (!check(TokenType::RBRACE) && !is_at_end()) {
@@ -239,9 +366,10 @@ private:
         }
 
         bytecode[locals_pos] = static_cast<uint8_t>(var_count);
+        chunk.local_count = var_count;
 
         if (!has_returned && current_ret_type != Type::VOID) {
-            throw std::runtime_error("Function '" + func_name + "' must return a value.");
+            throw std::runtime_error("Function '" + std::string(func.name) + "' must return a value.");
         }
 
         if (!has_returned) {
@@ -253,10 +381,19 @@ private:
         if (!match(TokenType::RBRACE)) {
             throw std::runtime_error("Expected '}' after function body.");
         }
+    }
 
-        current_function = nullptr;
-        current_ret_type = Type::VOID;
-        has_returned = false;
+    // a copy of the chunk compiled so far at its exact size, the buffers keep
+    // their capacity for the next body
+    Chunk take_chunk() {
+        Chunk done = chunk;
+        done.code = bytecode;
+        done.lines = lines;
+
+        chunk.clear();
+        bytecode.clear();
+        lines.clear();
+        return done;
     }
 
     void return_statement() {
@@ -265,13 +402,7 @@ private:
         }
 
         if (current_ret_type != Type::VOID) {
-            expression();
-
-            Type type;
-            if (peek().value == "int") type = Type::INT;
-            else if (peek().value == "bool") type = Type::BOOL;
-            else if (peek().value == "string") type = Type::STRING;
-            else throw std::runtime_error("Unknown return type.");
+            Type type = expression();
 
             if (type != current_ret_type) {
                 throw std::runtime_error("Return value type doesn't match function return type.");
@@ -286,8 +417,359 @@ private:
         has_returned = true;
     }
 
-    void call() {
-        std::string func_name = previous().value;
+    struct ArrayBuiltin {
+        std::string_view name;
+        OpCode           op;
+        size_t           argc;
+        bool             returns_array;  // the in place ones hand back their array
+    };
+
+    static const ArrayBuiltin* array_builtin(std::string_view name) {
+        static const ArrayBuiltin builtins[] = {
+            {"sum",     OpCode::ASUM,   1, false},
+            {"min",     OpCode::AMIN,   1, false},
+            {"max",     OpCode::AMAX,   1, false},
+            {"indexOf", OpCode::AFIND,  2, false},
+            {"count",   OpCode::ACOUNT, 2, false},
+            {"fill",    OpCode::AFILL,  2, true},
+            {"add",     OpCode::AADD,   2, true},
+            {"mul",     OpCode::AMUL,   2, true},
+        };
+
+        for (const auto& b : builtins) {
+            if (b.name == name) return &b;
+        }
+        return nullptr;
+    }
+
+    Type array_builtin_call(const Token& name_tok, const ArrayBuiltin& builtin) {
+        std::string name(builtin.name);
+
+        if (!match(TokenType::LPAREN)) {
+            throw std::runtime_error("Expected '(' after function name.");
+        }
+
+        Type array_type = Type::VOID;
+        size_t arg_count = 0;
+        if (!check(TokenType::RPAREN)) {
+            do {
+                Type type = expression();
+                if (arg_count == 0) array_type = type;
+                arg_count++;
+            } while (match(TokenType::COMMA));
+        }
+
+        if (!match(TokenType::RPAREN)) {
+            throw std::runtime_error("Expected ')' after " + name + " arguments.");
+        }
+
+        if (arg_count != builtin.argc) {
+            throw std::runtime_error(name + "() takes " + std::to_string(builtin.argc) + " argument(s).");
+        }
+
+        if (array_type != Type::ARRAY && array_type != Type::VECTOR) {
+            throw std::runtime_error(name + "() expects an int array.");
+        }
+
+        at(name_tok);
+        emitByte(static_cast<uint8_t>(builtin.op));
+        return builtin.returns_array ? array_type : Type::INT;
+    }
+
+    // comma separated arguments checked against func's parameters, returns how many
+    size_t arguments(const Function& func) {
+        size_t arg_count = 0;
+        do {
+            if (arg_count >= func.params.size()) {
+                throw std::runtime_error("Too many arguments to function '" + std::string(func.name) + "'");
+            }
+
+            Type type = expression();
+
+            if (type != func.params[arg_count].type) {
+                throw std::runtime_error("Argument type mismatch.");
+            }
+
+            arg_count++;
+        } while (match(TokenType::COMMA));
+
+        if (arg_count != func.params.size()) {
+            throw std::runtime_error("Wrong number of arguments to function '" + std::string(func.name) + "'");
+        }
+
+        return arg_count;
+    }
+
+    void emitCall(OpCode op, const Function& func, size_t arg_count) {
+        emitByte(static_cast<uint8_t>(op));
+
+        // function offset, filled in once the body has its place in the module
+        chunk.calls.push_back({bytecode.size(), func.id});
+        for (int i = 0; i < 4; i++) emitByte(0x0);
+        emitByte(static_cast<uint8_t>(arg_count));
+    }
+
+    // the function being compiled touches state outside its own frame
+    void side_effect() {
+        if (current_function) chunk.side_effects = true;
+    }
+
+    static bool is_parallel_builtin(std::string_view name) {
+        return name == "pmap" || name == "parallel_for";
+    }
+
+    // pmap(a, fn) builds a new array of fn(a[i]), parallel_for(a, fn) stores
+    // fn(a[i]) back into a. the calls run on worker threads, so fn must be pure
+    // and take and return a single int or bool.
+    Type parallel_builtin_call(const Token& name_tok) {
+        std::string name(name_tok.value);
+        bool in_place = name == "parallel_for";
+
+        if (!match(TokenType::LPAREN)) {
+            throw std::runtime_error("Expected '(' after function name.");
+        }
+
+        Type array_type = check(TokenType::RPAREN) ? Type::VOID : expression();
+        if (array_type != Type::ARRAY && array_type != Type::VECTOR) {
+            throw std::runtime_error(name + "() expects an array.");
+        }
+
+        if (!match(TokenType::COMMA) || !match(TokenType::IDENTIFIER)) {
+            throw std::runtime_error(name + "() expects an array and a function name.");
+        }
+
+        std::string_view func_name = previous().value;
+        auto found = unit->functions.find(func_name);
+        if (found == unit->functions.end()) {
+            throw std::runtime_error("Undefined function '" + std::string(func_name) + "'");
+        }
+
+        const Function& func = found->second;
+        auto scalar = [](Type t) { return t == Type::INT || t == Type::BOOL; };
+        if (func.params.size() != 1 || !scalar(func.params[0].type) || !scalar(func.return_type)) {
+            throw std::runtime_error(name + "() needs a function taking and returning one int or bool.");
+        }
+        if (in_place && func.return_type != func.params[0].type) {
+            throw std::runtime_error("parallel_for() needs a function returning its parameter's type.");
+        }
+        // whether it is pure is only known once every body is compiled
+        chunk.parallel.push_back({func.id, in_place});
+
+        if (!match(TokenType::RPAREN)) {
+            throw std::runtime_error("Expected ')' after " + name + " arguments.");
+        }
+
+        // the argument count byte of the call encoding carries the parameter type
+        at(name_tok);
+        emitCall(in_place ? OpCode::PFOR : OpCode::PMAP, func, static_cast<uint8_t>(func.params[0].type));
+        emitByte(static_cast<uint8_t>(func.return_type));
+        return array_type;
+    }
+
+    static bool is_channel_builtin(std::string_view name) {
+        return name == "channel" || name == "send" || name == "recv" || name == "try_recv";
+    }
+
+    // channel(name) opens the channel shared under that name by every vm in the
+    // process and gives back a handle. send(c, v) queues an int, bool or string,
+    // recv(c) waits for the next message and try_recv(c, fallback) returns the
+    // fallback when there is none.
+    Type channel_builtin_call(const Token& name_tok) {
+        std::string name(name_tok.value);
+        side_effect();
+
+        if (!match(TokenType::LPAREN)) {
+            throw std::runtime_error("Expected '(' after function name.");
+        }
+
+        Type result = Type::INT;
+        if (name == "channel") {
+            if (check(TokenType::RPAREN) || expression() != Type::STRING) {
+                throw std::runtime_error("channel() expects a name.");
+            }
+        } else {
+            if (check(TokenType::RPAREN) || expression() != Type::INT) {
+                throw std::runtime_error(name + "() expects a channel handle.");
+            }
+
+            if (name == "send" || name == "try_recv") {
+                Type type = match(TokenType::COMMA) ? expression() : Type::VOID;
+                if (type != Type::INT && type != Type::BOOL && type != Type::STRING) {
+                    throw std::runtime_error(name + "() expects an int, bool or string as its second argument.");
+                }
+                result = name == "send" ? Type::VOID : type;
+            }
+        }
+
+        if (!match(TokenType::RPAREN)) {
+            throw std::runtime_error("Expected ')' after " + name + " arguments.");
+        }
+
+        at(name_tok);
+        if (name == "channel") emitByte(static_cast<uint8_t>(OpCode::CHOPEN));
+        else if (name == "send") emitByte(static_cast<uint8_t>(OpCode::CHSEND));
+        else if (name == "recv") emitByte(static_cast<uint8_t>(OpCode::CHRECV));
+        else emitByte(static_cast<uint8_t>(OpCode::CHTRY));
+        return result;
+    }
+
+    size_t native_import(const NativeFunction& native) {
+        auto it = native_index.find(native.name);
+        if (it != native_index.end()) return it->second;
+
+        if (native_imports.size() > 0xFFFF) {
+            throw std::runtime_error("Too many native functions in one module.");
+        }
+
+        native_imports.push_back(&native);
+        native_index[native.name] = native_imports.size() - 1;
+        return native_imports.size() - 1;
+    }
+
+    // a host function from the registry. the arguments stay on the stack, the
+    // host reads them in place and its result replaces them.
+    Type native_call(const Token& name_tok, const NativeFunction& native) {
+        if (!match(TokenType::LPAREN)) {
+            throw std::runtime_error("Expected '(' after function name.");
+        }
+
+        size_t arg_count = 0;
+        if (!check(TokenType::RPAREN)) {
+            do {
+                if (arg_count >= native.param_types.size()) {
+                    throw std::runtime_error("Too many arguments to function '" + native.name + "'");
+                }
+                if (expression() != native.param_types[arg_count]) {
+                    throw std::runtime_error("Argument type mismatch.");
+                }
+                arg_count++;
+            } while (match(TokenType::COMMA));
+        }
+
+        if (arg_count != native.param_types.size()) {
+            throw std::runtime_error("Wrong number of arguments to function '" + native.name + "'");
+        }
+
+        if (!match(TokenType::RPAREN)) {
+            throw std::runtime_error("Expected ')' after arguments.");
+        }
+
+        if (!native.pure) side_effect();
+
+        at(name_tok);
+        emitByte(static_cast<uint8_t>(OpCode::CALLNATIVE));
+        chunk.natives.push_back({bytecode.size(), &native});
+        emitBytes(0x0, 0x0);
+        emitByte(static_cast<uint8_t>(arg_count));
+        return native.return_type;
+    }
+
+    // checkpoint() marks where a snapshot of the vm is taken when the host asks
+    // for one, otherwise it does nothing
+    Type checkpoint_call(const Token& name_tok) {
+        side_effect();
+
+        if (!match(TokenType::LPAREN) || !match(TokenType::RPAREN)) {
+            throw std::runtime_error("checkpoint() takes no arguments.");
+        }
+
+        at(name_tok);
+        emitByte(static_cast<uint8_t>(OpCode::CHECKPOINT));
+        return Type::VOID;
+    }
+
+    static bool is_task_builtin(std::string_view name) {
+        return name == "spawn" || name == "yield" || name == "join" ||
+               name == "read_file" || name == "write_file";
+    }
+
+    // spawn(fn, args...) starts fn as a new task and gives back its handle,
+    // yield() lets other tasks run, join(handle) waits for a task and gives back
+    // what its function returned. read_file(path) and write_file(path, text)
+    // hand back a handle too, joining it gives the contents or the bytes written.
+    Type task_builtin_call(const Token& name_tok) {
+        std::string_view name = name_tok.value;
+        side_effect();
+
+        if (!match(TokenType::LPAREN)) {
+            throw std::runtime_error("Expected '(' after function name.");
+        }
+
+        if (name == "read_file" || name == "write_file") {
+            bool write = name == "write_file";
+            std::string label(name);
+
+            if (check(TokenType::RPAREN) || expression() != Type::STRING) {
+                throw std::runtime_error(label + "() expects a file path.");
+            }
+
+            if (write && (!match(TokenType::COMMA) || expression() != Type::STRING)) {
+                throw std::runtime_error("write_file() expects a path and a string.");
+            }
+
+            if (!match(TokenType::RPAREN)) {
+                throw std::runtime_error("Expected ')' after " + label + " arguments.");
+            }
+
+            at(name_tok);
+            emitByte(static_cast<uint8_t>(write ? OpCode::WRITEF : OpCode::READF));
+            return Type::INT;
+        }
+
+        if (name == "yield") {
+            if (!match(TokenType::RPAREN)) {
+                throw std::runtime_error("yield() takes no arguments.");
+            }
+
+            at(name_tok);
+            emitByte(static_cast<uint8_t>(OpCode::YIELD));
+            return Type::VOID;
+        }
+
+        if (name == "join") {
+            if (check(TokenType::RPAREN) || expression() != Type::INT) {
+                throw std::runtime_error("join() expects a task handle.");
+            }
+
+            if (!match(TokenType::RPAREN)) {
+                throw std::runtime_error("Expected ')' after join argument.");
+            }
+
+            at(name_tok);
+            emitByte(static_cast<uint8_t>(OpCode::JOIN));
+            return Type::INT;
+        }
+
+        if (!match(TokenType::IDENTIFIER)) {
+            throw std::runtime_error("spawn() expects a function name.");
+        }
+
+        std::string_view func_name = previous().value;
+        auto found = unit->functions.find(func_name);
+        if (found == unit->functions.end()) {
+            throw std::runtime_error("Undefined function '" + std::string(func_name) + "'");
+        }
+
+        const Function& func = found->second;
+        size_t arg_count = 0;
+        if (match(TokenType::COMMA)) {
+            arg_count = arguments(func);
+        } else if (!func.params.empty()) {
+            throw std::runtime_error("Wrong number of arguments to function '" + std::string(func_name) + "'");
+        }
+
+        if (!match(TokenType::RPAREN)) {
+            throw std::runtime_error("Expected ')' after spawn arguments.");
+        }
+
+        at(name_tok);
+        emitCall(OpCode::SPAWN, func, arg_count);
+        return Type::INT;
+    }
+
+    Type call() {
+        Token name_tok = previous();
+        std::string_view func_name = name_tok.value;
         
         if (func_name == "print" || func_name == "size") {
             if (!match(TokenType::LPAREN)) {
@@ -307,9 +789,11 @@ private:
                     throw std::runtime_error("Expected ')' after print arguments.");
                 }
 
+                at(name_tok);
+                side_effect();
                 emitByte(static_cast<uint8_t>(OpCode::PRINT));
                 emitByte(static_cast<uint8_t>(arg_count));
-                return;
+                return Type::VOID;
             }
             
             if (func_name == "size") {
@@ -323,100 +807,107 @@ private:
                     throw std::runtime_error("Expected ')' after size argument.");
                 }
 
+                at(name_tok);
                 emitByte(static_cast<uint8_t>(OpCode::ASIZE));
-                return;
+                return Type::INT;
             }
         }
 
-        if (functions.find(func_name) == functions.end()) {
-            throw std::runtime_error("Undefined function '" + func_name + "'");
+        // user functions shadow natives, natives shadow the array, task, parallel,
+        // channel and checkpoint builtins
+        if (unit->functions.find(func_name) == unit->functions.end()) {
+            if (const NativeFunction* native = natives ? natives->find(func_name) : nullptr) {
+                return native_call(name_tok, *native);
+            }
+            if (const ArrayBuiltin* builtin = array_builtin(func_name)) {
+                return array_builtin_call(name_tok, *builtin);
+            }
+            if (is_task_builtin(func_name)) {
+                return task_builtin_call(name_tok);
+            }
+            if (is_parallel_builtin(func_name)) {
+                return parallel_builtin_call(name_tok);
+            }
+            if (is_channel_builtin(func_name)) {
+                return channel_builtin_call(name_tok);
+            }
+            if (func_name == "checkpoint") {
+                return checkpoint_call(name_tok);
+            }
         }
 
-        Function& func = functions[func_name];
-
-        if (!match(TokenType::LPAREN)) {
-            throw std::runtime_error("Expected '(' after function name.");
+        auto found = unit->functions.find(func_name);
+        if (found == unit->functions.end()) {
+            throw std::runtime_error("Undefined function '" + std::string(func_name) + "'");
         }
 
-        size_t arg_count = 0;
-        if (!check(TokenType::RPAREN)) {
-            do {
-                if (arg_count >= func.params.size()) {
-                    throw std::runtime_error("Too many arguments to function '" + func_name + "'");
-                }
+        const Function& func = found->second;
 
-                expression();
-                
-                Type type;
-                if (peek().value == "int") type = Type::INT;
-                else if (peek().value == "bool") type = Type::BOOL;
-                else if (peek().value == "string") type = Type::STRING;
-                else throw std::runtime_error("Unknown return type: " + std::to_string(static_cast<int>(type)));
-
-                if (type != func.params[arg_count].type) {
-                    throw std::runtime_error("Argument type mismatch.");
-                }
-
-                arg_count++;
-            } while (match(TokenType::COMMA));
+        if (!match(TokenType::LPAREN)) {
+            throw std::runtime_error("Expected '(' after function name.");
         }
 
-        if (arg_count != func.params.size()) {
-            throw std::runtime_error("Wrong number of arguments to function '" + func_name + "'");
-        }
+        size_t arg_count = check(TokenType::RPAREN) ? 0 : arguments(func);
 
         if (!match(TokenType::RPAREN)) {
             throw std::runtime_error("Expected ')' after arguments.");
         }
 
-        emitByte(static_cast<uint8_t>(OpCode::CALL));
+        if (current_function) chunk.callees.push_back(func.id);
 
-        // function offset
-        emitByte(static_cast<uint8_t>((func.bytecode_offset >> 24) & 0xFF));
-        emitByte(static_cast<uint8_t>((func.bytecode_offset >> 16) & 0xFF));
-        emitByte(static_cast<uint8_t>((func.bytecode_offset >> 8) & 0xFF));
-        emitByte(static_cast<uint8_t>(func.bytecode_offset & 0xFF));
+        at(name_tok);
+        emitCall(OpCode::CALL, func, arg_count);
+        return func.return_type;
     }
 
-    void number() {
-        int value = std::stoi(previous().value);
+    Type number() {
+        std::string_view text = previous().value;
+        int value = 0;
+        auto res = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (res.ec != std::errc()) {
+            throw std::runtime_error("Integer literal '" + std::string(text) + "' out of range.");
+        }
         emitConstant(value);
+        return Type::INT;
     }
 
-    void boolean() {
+    Type boolean() {
         uint8_t value = 0x80 | (previous().type == TokenType::TRUE ? 0x01 : 0x00);
         emitByte(static_cast<uint8_t>(OpCode::PUSH));
         emitByte(value);
+        return Type::BOOL;
     }
 
-    void string() {
-        std::string value = previous().value;
-        emitByte(static_cast<uint8_t>(OpCode::PUSHK));
-        emitByte(0xFF);
-        for (char c : value) {
-            emitByte(static_cast<uint8_t>(c));
-        }
-        emitByte(0);
+    Type string() {
+        emitByte(static_cast<uint8_t>(OpCode::PUSHS));
+        chunk.strings.push_back({bytecode.size(), previous().value});
+        emitBytes(0x0, 0x0);
+        return Type::STRING;
     }
 
-    void unary() {
+    Type unary() {
         Token op = previous();
         expression();
+        at(op);
 
         if (op.value == "!") emitByte(static_cast<uint8_t>(OpCode::NOT));
         else if (op.value == "++") emitByte(static_cast<uint8_t>(OpCode::INC));
         else if (op.value == "--") emitByte(static_cast<uint8_t>(OpCode::DEC));
         else if (op.value == "-") emitByte(static_cast<uint8_t>(OpCode::NEG));
+
+        return op.value == "!" ? Type::BOOL : Type::INT;
     }
 
-    void variable() {
-        std::string name = previous().value;
-        if (variables.find(name) == variables.end()) {
-            throw std::runtime_error("Undefined variable '" + name + "'");
+    Type variable() {
+        std::string_view name = previous().value;
+        auto var = variables.find(name);
+        if (var == variables.end()) {
+            throw std::runtime_error("Undefined variable '" + std::string(name) + "'");
         }
 
         emitByte(static_cast<uint8_t>(OpCode::LOAD));
-        emitByte(static_cast<uint8_t>(variables[name]));
+        emitByte(static_cast<uint8_t>(var->second.slot));
+        return var->second.type;
     }
 
     void declaration() {
@@ -424,7 +915,7 @@ private:
             throw std::runtime_error("Expected type declaration.");
         }
 
-        std::string type = previous().value;
+        std::string_view type = previous().value;
 
         bool is_arr = false;
         bool is_vec = false;
@@ -445,13 +936,23 @@ private:
             throw std::runtime_error("Expected variable name, got type " + std::to_string(static_cast<int>(peek().type)));
         }
 
-        std::string name = previous().value;
+        std::string_view name = previous().value;
 
         if (variables.find(name) != variables.end()) {
-            throw std::runtime_error("Variable '" + name + "' already declared.");
+            throw std::runtime_error("Variable '" + std::string(name) + "' already declared.");
         }
 
-        variables[name] = var_count++;
+        // slots are one byte operands and ENTER counts them in one byte too
+        if (var_count >= 255) {
+            throw std::runtime_error("Too many local variables.");
+        }
+
+        Type var_type = parse_type(type);
+        if (is_arr || is_vec) {
+            variables[name] = {var_count++, is_arr ? Type::ARRAY : Type::VECTOR, var_type};
+        } else {
+            variables[name] = {var_count++, var_type, Type::VOID};
+        }
 
         if (is_arr || is_vec) {
             array(is_vec);
@@ -463,16 +964,18 @@ private:
         }
 
         emitByte(static_cast<uint8_t>(OpCode::STORE));
-        emitByte(static_cast<uint8_t>(variables[name]));
+        emitByte(static_cast<uint8_t>(variables[name].slot));
 
         if (!match(TokenType::SEMI)) {
             throw std::runtime_error("Expected ';' after variable declaration.");
         }
     }
 
-    void binary() {
-        std::string op = previous().value;
-        expression(); // compile right-oper
+    Type binary(Type left) {
+        Token op_tok = previous();
+        std::string_view op = op_tok.value;
+        Type right = expression(); // compile right-oper
+        at(op_tok);
 
         if (op == "+") emitByte(static_cast<uint8_t>(OpCode::ADD));
         else if (op == "-") emitByte(static_cast<uint8_t>(OpCode::SUB));
@@ -485,34 +988,43 @@ private:
         else if (op == "<=") emitByte(static_cast<uint8_t>(OpCode::LTE));
         else if (op == "==") emitByte(static_cast<uint8_t>(OpCode::EQ));
         else if (op == "!=") emitByte(static_cast<uint8_t>(OpCode::NEQ));
+
+        if (op == "+" && (left == Type::STRING || right == Type::STRING)) return Type::STRING;
+        if (op == "+" || op == "-" || op == "*" || op == "/" || op == "%") return Type::INT;
+        return Type::BOOL;
     }
 
-    void grouping() {
-        expression();
+    Type grouping() {
+        Type type = expression();
         if (!match(TokenType::RPAREN))
             throw std::runtime_error("Expected ')' after grouped expression.");
+        return type;
     }
 
-    void expression() {
-        if (match(TokenType::NUMBER)) number();
-        else if (match(TokenType::STRING)) string();
-        else if (match(TokenType::TRUE) || match(TokenType::FALSE)) boolean();
+    // compiles an expression and returns its static type
+    Type expression() {
+        Type type;
+
+        if (match(TokenType::NUMBER)) type = number();
+        else if (match(TokenType::STRING)) type = string();
+        else if (match(TokenType::TRUE) || match(TokenType::FALSE)) type = boolean();
         else if (match(TokenType::IDENTIFIER)) {
-            std::string name = previous().value;
             if (peek().type == TokenType::LPAREN) {
-                call();
+                type = call();
             } else if (peek().type == TokenType::LBRACKET) {
-                array_index();
+                type = array_index();
             } else {
-                variable();
+                type = variable();
             }
         }
-        else if (match(TokenType::PREFIX)) unary();
-        else if (match(TokenType::LPAREN)) grouping();
+        else if (match(TokenType::PREFIX)) type = unary();
+        else if (match(TokenType::LPAREN)) type = grouping();
         else throw std::runtime_error("Expected expression.");
 
         while (match(TokenType::OPERATOR) || match(TokenType::POSTFIX))
-            binary();
+            type = binary(type);
+
+        return type;
     }
 
     // patch jump
@@ -563,7 +1075,11 @@ private:
 
     void statement() {
         if (match(TokenType::FUNCTION)) {
-            function();
+            if (current_function != nullptr) {
+                throw std::runtime_error("Nested function declarations are not supported.");
+            }
+            // declarations() has the signature, the body is compiled on its own
+            current = unit->functions.at(peek().value).end;
         } else if (match(TokenType::RETURN)) {
             return_statement();
         } else if (match(TokenType::IF)) {
@@ -580,18 +1096,203 @@ private:
         }
     }
 
+    // drops every arena backed table, then hands the arena's blocks back in one go
+    void release() {
+        tokens = TokenList(ArenaAllocator<Token>(arena));
+        variables = ArenaMap<Local>(ArenaAllocator<std::pair<const std::string_view, Local>>(arena));
+        constants = ArenaVector<std::string_view>(ArenaAllocator<std::string_view>(arena));
+        constant_index = ArenaMap<size_t>(ArenaAllocator<std::pair<const std::string_view, size_t>>(arena));
+        functions = ArenaMap<Function>(ArenaAllocator<std::pair<const std::string_view, Function>>(arena));
+        function_order = ArenaVector<std::string_view>(ArenaAllocator<std::string_view>(arena));
+        native_index = ArenaMap<size_t>(ArenaAllocator<std::pair<const std::string_view, size_t>>(arena));
+        native_imports.clear();
+        current_function = nullptr;
+        chunk = Chunk();
+
+        arena.reset();
+    }
+
+    static const size_t BODIES_PER_THREAD = 32;  // fewer than this and a thread costs more than it saves
+
+    // compiles every function body, on as many threads as there are cores and
+    // enough bodies to share, while this thread compiles the top level. the
+    // first error in source order is the one reported, whichever thread hit it.
+    std::vector<Chunk> compile_bodies() {
+        size_t count = function_order.size();
+        std::vector<Chunk> bodies(count);
+        std::vector<std::pair<size_t, std::string>> errors(count + 1, {SIZE_MAX, ""});  // token, message
+        std::atomic<size_t> next{0};
+
+        auto work = [&]() {
+            Compiler body(this);
+            for (size_t i; (i = next.fetch_add(1)) < count;) {
+                try {
+                    body.function_body(functions.at(function_order[i]));
+                } catch (const std::exception& e) {
+                    errors[i] = {body.current, e.what()};
+                }
+                bodies[i] = body.take_chunk();
+            }
+        };
+
+        size_t workers = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+        workers = std::min(workers, count / BODIES_PER_THREAD);
+        std::vector<std::thread> pool;
+        for (size_t i = 1; i < workers; i++) pool.emplace_back(work);
+
+        try {
+            while (!is_at_end()) {
+                statement();
+            }
+            emitByte(static_cast<uint8_t>(OpCode::HALT));
+        } catch (const std::exception& e) {
+            errors[count] = {current, e.what()};
+        }
+
+        work();
+        for (auto& t : pool) t.join();
+
+        auto first = std::min_element(errors.begin(), errors.end(),
+                                      [](const auto& a, const auto& b) { return a.first < b.first; });
+        if (first->first != SIZE_MAX) throw std::runtime_error(first->second);
+        return bodies;
+    }
+
+    static void put_u16(std::vector<uint8_t>& code, size_t pos, size_t v) {
+        code[pos] = static_cast<uint8_t>((v >> 8) & 0xFF);
+        code[pos + 1] = static_cast<uint8_t>(v & 0xFF);
+    }
+
+    // fills in the operands a chunk left open, its code starts at base
+    void relocate(const Chunk& c, size_t base, const std::vector<Function*>& by_id) {
+        for (const auto& [pos, id] : c.calls) {
+            size_t offset = by_id[id]->bytecode_offset;
+            put_u16(bytecode, base + pos, offset >> 16);
+            put_u16(bytecode, base + pos + 2, offset & 0xFFFF);
+        }
+        for (const auto& [pos, text] : c.strings) put_u16(bytecode, base + pos, makeConstant(text));
+        for (const auto& [pos, native] : c.natives) put_u16(bytecode, base + pos, native_import(*native));
+    }
+
+    // lays the bodies out after the top level in declaration order and patches
+    // every chunk against the final layout. constants and native imports are
+    // numbered in that same order, so the module does not depend on the threads.
+    void link(std::vector<Chunk>& bodies) {
+        Chunk top = std::move(chunk);
+        chunk = Chunk();
+
+        std::vector<Function*> by_id;
+        for (const auto& name : function_order) by_id.push_back(&functions.at(name));
+
+        for (size_t i = 0; i < bodies.size(); i++) {
+            Function& func = *by_id[i];
+            func.bytecode_offset = bytecode.size();
+            func.local_count = bodies[i].local_count;
+
+            lines.append(bodies[i].lines, static_cast<uint32_t>(bytecode.size()));
+            bytecode.insert(bytecode.end(), bodies[i].code.begin(), bodies[i].code.end());
+        }
+
+        relocate(top, 0, by_id);
+        for (size_t i = 0; i < bodies.size(); i++) {
+            relocate(bodies[i], by_id[i]->bytecode_offset, by_id);
+        }
+
+        // a function is pure when it has no side effects of its own and calls no
+        // impure function, so impurity spreads from callees back to callers
+        std::vector<std::vector<size_t>> callers(bodies.size());
+        std::vector<size_t> impure;
+        for (size_t i = 0; i < bodies.size(); i++) {
+            for (size_t callee : bodies[i].callees) callers[callee].push_back(i);
+            if (bodies[i].side_effects) impure.push_back(i);
+        }
+
+        while (!impure.empty()) {
+            size_t id = impure.back();
+            impure.pop_back();
+
+            if (!by_id[id]->pure) continue;
+            by_id[id]->pure = false;
+            for (size_t caller : callers[id]) impure.push_back(caller);
+        }
+
+        auto check_parallel = [&](const Chunk& c) {
+            for (const auto& [id, in_place] : c.parallel) {
+                const Function& func = *by_id[id];
+                if (!func.pure) {
+                    throw std::runtime_error("'" + std::string(func.name) + "' has side effects and cannot run in " +
+                                             (in_place ? "parallel_for" : "pmap") + "().");
+                }
+            }
+        };
+        check_parallel(top);
+        for (const auto& body : bodies) check_parallel(body);
+    }
+
+    // a compiler for function bodies, sharing the tokens and signatures of unit
+    explicit Compiler(const Compiler* unit)
+        : tokens(ArenaAllocator<Token>(arena)),
+          current(0),
+          variables(ArenaAllocator<std::pair<const std::string_view, Local>>(arena)),
+          constants(ArenaAllocator<std::string_view>(arena)),
+          constant_index(ArenaAllocator<std::pair<const std::string_view, size_t>>(arena)),
+          functions(ArenaAllocator<std::pair<const std::string_view, Function>>(arena)),
+          function_order(ArenaAllocator<std::string_view>(arena)),
+          unit(unit),
+          natives(unit->natives),
+          native_index(ArenaAllocator<std::pair<const std::string_view, size_t>>(arena)) {}
+
 public:
-    Compiler(const std::vector<Token>& tokens) : tokens(tokens), current(0) {}
+    // natives, when given, must outlive the compiler
+    Compiler(const std::string& source, const NativeRegistry* natives = nullptr)
+        : tokens(ArenaAllocator<Token>(arena)),
+          current(0),
+          variables(ArenaAllocator<std::pair<const std::string_view, Local>>(arena)),
+          constants(ArenaAllocator<std::string_view>(arena)),
+          constant_index(ArenaAllocator<std::pair<const std::string_view, size_t>>(arena)),
+          functions(ArenaAllocator<std::pair<const std::string_view, Function>>(arena)),
+          function_order(ArenaAllocator<std::string_view>(arena)),
+          unit(this),
+          natives(natives),
+          native_index(ArenaAllocator<std::pair<const std::string_view, size_t>>(arena)) {
+        tokens = Lexer(source, arena).generate();
+    }
     
-    std::vector<uint8_t> compile() {
+    void set_threads(size_t n) { threads = n; }
+
+    // compiles the whole source, all per-compilation memory is released before returning
+    Module compile() {
+        if (tokens.empty()) {
+            throw std::runtime_error("Compiler can only compile once.");
+        }
+
         bytecode.clear();
 
-        while (!is_at_end()) {
-            statement();
+        declarations();
+        std::vector<Chunk> bodies = compile_bodies();
+        link(bodies);
+
+        Module module;
+        module.code = std::move(bytecode);
+        module.lines = std::move(lines);
+        module.constants.assign(constants.begin(), constants.end());
+
+        for (const auto& name : function_order) {
+            const Function& func = functions.at(name);
+            FunctionInfo info;
+            info.name = std::string(func.name);
+            info.return_type = func.return_type;
+            for (const auto& param : func.params) info.param_types.push_back(param.type);
+            info.offset = static_cast<uint32_t>(func.bytecode_offset);
+            info.local_count = static_cast<uint8_t>(func.local_count);
+            module.functions.push_back(std::move(info));
         }
 
-        emitByte(static_cast<uint8_t>(OpCode::HALT));
+        for (const NativeFunction* native : native_imports) {
+            module.natives.push_back({native->name, native->return_type, native->param_types});
+        }
 
-        return bytecode;
+        release();
+        return module;
     }
 };
\ No newline at end of file
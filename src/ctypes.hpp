@@ -1,8 +1,9 @@
+#include <cstddef>
+#include <cstdint>
 #include <stdexcept>
 #include <vector>
 #include <string>
-#include <memory>
-#include <variant>
+#include <string_view>
 
 // cvm types
 #pragma once
@@ -16,68 +17,172 @@ enum class Type {
     VOID,
 };
 
+// heap objects, allocated and traced by the Heap (heap.hpp).
+// every object starts with an Obj header and is never moved once it is old.
+enum class ObjKind : uint8_t {
+    STRING,
+    ROPE,
+    ARRAY,
+    BUFFER,
+};
+
+static const size_t OBJ_KIND_COUNT = 4;
+
+inline const char* obj_kind_name(ObjKind kind) {
+    switch (kind) {
+        case ObjKind::STRING: return "string";
+        case ObjKind::ROPE:   return "rope";
+        case ObjKind::ARRAY:  return "array";
+        case ObjKind::BUFFER: return "buffer";
+    }
+    return "unknown";
+}
+
+enum ObjFlags : uint8_t {
+    OBJ_OLD        = 0x01,  // lives in the old generation
+    OBJ_MARKED     = 0x02,  // reached during a major collection
+    OBJ_FORWARDED  = 0x04,  // young object that was promoted, link holds the new address
+    OBJ_REMEMBERED = 0x08,  // old object in the remembered set
+    OBJ_INTERNED   = 0x10,  // the one string in the intern table with this content
+    OBJ_FROZEN     = 0x20,  // immutable string shared between heaps, see freeze_string()
+};
+
+struct Obj {
+    uint32_t size;   // bytes including this header
+    ObjKind  kind;
+    uint8_t  flags;
+    uint16_t aux;
+    Obj*     link;   // forwarding address while young, next old object once promoted
+};
+
+// a string value is either flat (kind STRING, characters inline) or a rope node
+// (kind ROPE) that concatenates two other strings. length is valid for both.
+struct StringObject : Obj {
+    uint32_t length;
+    uint32_t hash;    // 0 until computed, see string_hash()
+
+    bool is_flat() const { return kind == ObjKind::STRING; }
+
+    // flat strings only
+    char* chars() { return reinterpret_cast<char*>(this + 1); }
+    const char* chars() const { return reinterpret_cast<const char*>(this + 1); }
+    std::string_view view() const { return std::string_view(chars(), length); }
+};
+
+struct RopeObject : StringObject {
+    StringObject* left;
+    StringObject* right;  // null once flattened, left then holds the flat copy
+};
+
+// calls f(std::string_view) for each flat piece of s, left to right
+template <typename F>
+void each_piece(const StringObject* s, F&& f) {
+    const StringObject* small[32];
+    std::vector<const StringObject*> spill;
+    size_t n = 0;
+
+    auto push = [&](const StringObject* p) {
+        if (n < 32) small[n++] = p;
+        else spill.push_back(p);
+    };
+    auto pop = [&]() -> const StringObject* {
+        if (!spill.empty()) {
+            const StringObject* p = spill.back();
+            spill.pop_back();
+            return p;
+        }
+        return small[--n];
+    };
+
+    push(s);
+    while (n > 0 || !spill.empty()) {
+        const StringObject* cur = pop();
+        while (!cur->is_flat()) {
+            const RopeObject* r = static_cast<const RopeObject*>(cur);
+            if (r->right) push(r->right);
+            cur = r->left;
+        }
+        f(cur->view());
+    }
+}
+
 class Value;
 
-class ArrayValue {
-public:
-    Type element_type;
-    std::vector<Value> elements;
-    
-    ArrayValue(Type type) : element_type(type) {}
-    
-    void set(size_t index, const Value& value);
-    Value get(size_t index) const;
-    size_t size() const { return elements.size(); }
+// bytes one element of an array takes, elements are stored unboxed
+inline size_t element_size(Type element_type) {
+    switch (element_type) {
+        case Type::INT:    return sizeof(int32_t);
+        case Type::BOOL:   return sizeof(uint8_t);
+        case Type::STRING: return sizeof(StringObject*);
+        default: throw std::runtime_error("[cvm] Invalid array element type");
+    }
+}
+
+// element storage for arrays and vectors: int32_t for int, one byte per bool and
+// string references for string. every slot up to capacity is zeroed, so string
+// slots past the length are null.
+struct BufferObject : Obj {
+    uint32_t capacity;
+    Type     element_type;
+
+    template <typename T>
+    T* as() { return reinterpret_cast<T*>(this + 1); }
+    template <typename T>
+    const T* as() const { return reinterpret_cast<const T*>(this + 1); }
+
+    int32_t* ints() { return as<int32_t>(); }
+    uint8_t* bools() { return as<uint8_t>(); }
+    StringObject** strings() { return as<StringObject*>(); }
 };
 
-class VectorValue {
-public:
-    Type element_type;
-    std::vector<Value> elements;
-    
-    VectorValue(Type type) : element_type(type) {}
-    
-    void set(size_t index, const Value& value);
+struct ArrayObject : Obj {
+    Type          element_type;
+    uint32_t      length;
+    BufferObject* buffer;
+
+    size_t size() const { return length; }
     Value get(size_t index) const;
-    void push_back(const Value& value);
-    size_t size() const { return elements.size(); }
 };
 
-// Updated Value class with std::variant
+// values are plain tagged words, heap values are references into the vm heap
 class Value {
 public:
     Type type;
-    
-    using ValueType = std::variant<int, bool, std::shared_ptr<std::string>, 
-                                   std::shared_ptr<ArrayValue>, std::shared_ptr<VectorValue>>;
+
     union {
         int ivalue;
         bool bvalue;
-        std::string* svalue;
-        ArrayValue* avalue;
-        VectorValue* vvalue;
+        StringObject* svalue;
+        ArrayObject* avalue;
+        ArrayObject* vvalue;
     };
 
     Value() : type(Type::INT), ivalue(0) {}
     explicit Value(int v) : type(Type::INT), ivalue(v) {}
     explicit Value(bool v) : type(Type::BOOL), bvalue(v) {}
-    explicit Value(const std::string& v) : type(Type::STRING), svalue(new std::string(v)) {}
-    explicit Value(const ArrayValue& v) : type(Type::ARRAY), avalue(new ArrayValue(v)) {}
-    explicit Value(const VectorValue& v) : type(Type::VECTOR), vvalue(new VectorValue(v)) {}
+    explicit Value(StringObject* s) : type(Type::STRING), svalue(s) {}
+    Value(Type t, ArrayObject* a) : type(t), avalue(a) {}
 
-    ~Value() {
+    bool is_heap() const {
+        return type == Type::STRING || type == Type::ARRAY || type == Type::VECTOR;
+    }
+
+    Obj* obj() const {
         switch (type) {
-            case Type::STRING:
-                delete svalue;
-                break;
+            case Type::STRING: return svalue;
             case Type::ARRAY:
-                delete avalue;
-                break;
-            case Type::VECTOR:
-                delete vvalue;
-                break;
-            default:
-                break;
+            case Type::VECTOR: return avalue;
+            default: return nullptr;
+        }
+    }
+
+    // repoints a heap value, used by the collector when it moves an object
+    void set_obj(Obj* o) {
+        switch (type) {
+            case Type::STRING: svalue = static_cast<StringObject*>(o); break;
+            case Type::ARRAY:
+            case Type::VECTOR: avalue = static_cast<ArrayObject*>(o); break;
+            default: break;
         }
     }
 
@@ -87,8 +192,11 @@ public:
                 return std::string("BOOL:") + (bvalue ? "true" : "false");
             case Type::INT:
                 return std::string("INT:") + std::to_string(ivalue);
-            case Type::STRING:
-                return std::string("STRING:\"") + *svalue + "\"";
+            case Type::STRING: {
+                std::string text;
+                each_piece(svalue, [&](std::string_view piece) { text += piece; });
+                return std::string("STRING:\"") + text + "\"";
+            }
             case Type::ARRAY:
                 return std::string("ARRAY[size=" + std::to_string(avalue->size()) + "]");
             case Type::VECTOR:
@@ -97,90 +205,17 @@ public:
                 return "UNKNOWN";
         }
     }
-
-    Value(const Value& other) : type(other.type) {
-        switch (type) {
-            case Type::INT:
-                ivalue = other.ivalue;
-                break;
-            case Type::BOOL:
-                bvalue = other.bvalue;
-                break;
-            case Type::STRING:
-                svalue = new std::string(*other.svalue);
-                break;
-            case Type::ARRAY:
-                avalue = new ArrayValue(*other.avalue);
-                break;
-            case Type::VECTOR:
-                vvalue = new VectorValue(*other.vvalue);
-                break;
-        }
-    }
-
-    Value& operator=(const Value& other) {
-        if (this != &other) {
-            this->~Value();
-            type = other.type;
-            switch (type) {
-                case Type::INT:
-                    ivalue = other.ivalue;
-                    break;
-                case Type::BOOL:
-                    bvalue = other.bvalue;
-                    break;
-                case Type::STRING:
-                    svalue = new std::string(*other.svalue);
-                    break;
-                case Type::ARRAY:
-                    avalue = new ArrayValue(*other.avalue);
-                    break;
-                case Type::VECTOR:
-                    vvalue = new VectorValue(*other.vvalue);
-                    break;
-            }
-        }
-        return *this;
-    }
 };
 
-inline void ArrayValue::set(size_t index, const Value& value) {
-    if (index >= elements.size()) {
-        throw std::runtime_error("[cvm] Array index out of bounds");
-    }
-    if (value.type != element_type) {
-        throw std::runtime_error("[cvm] Type mismatch in array assignment");
-    }
-    elements[index] = value;
-}
-
-inline Value ArrayValue::get(size_t index) const {
-    if (index >= elements.size()) {
+inline Value ArrayObject::get(size_t index) const {
+    if (index >= length) {
         throw std::runtime_error("[cvm] Array index out of bounds");
     }
-    return elements[index];
-}
-
-inline void VectorValue::set(size_t index, const Value& value) {
-    if (value.type != element_type) {
-        throw std::runtime_error("[cvm] Type mismatch in vector assignment");
-    }
-    if (index >= elements.size()) {
-        elements.resize(index + 1);
-    }
-    elements[index] = value;
-}
-
-inline Value VectorValue::get(size_t index) const {
-    if (index >= elements.size()) {
-        throw std::runtime_error("[cvm] Vector index out of bounds");
-    }
-    return elements[index];
-}
 
-inline void VectorValue::push_back(const Value& value) {
-    if (value.type != element_type) {
-        throw std::runtime_error("[cvm] Type mismatch in vector push_back");
+    switch (element_type) {
+        case Type::INT:    return Value(static_cast<int>(buffer->as<int32_t>()[index]));
+        case Type::BOOL:   return Value(buffer->as<uint8_t>()[index] != 0);
+        case Type::STRING: return Value(const_cast<StringObject*>(buffer->as<StringObject*>()[index]));
+        default: throw std::runtime_error("[cvm] Invalid array element type");
     }
-    elements.push_back(value);
 }
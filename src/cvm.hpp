@@ -1,162 +1,818 @@
 #pragma once
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <deque>
 #include <exception>
+#include <fstream>
 #include <iomanip>
 #include <string>
 #include <sys/types.h>
 #include <vector>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include <memory>
 #include <stdexcept>
+#include <unordered_map>
 
+#include "channel.hpp"
 #include "ctypes.hpp"
+#include "heap.hpp"
+#include "io.hpp"
+#include "module.hpp"
+#include "natives.hpp"
+#include "profiler.hpp"
 #include "opcodes.hpp"
+#include "output.hpp"
+#include "program.hpp"
+#include "simd.hpp"
+#include "snapshot.hpp"
+#include "strings.hpp"
 #include "common.hpp"
 
-class Frame;
-class VMStack;
-
 class Error : public std::runtime_error {
 public:
     explicit Error(const std::string& msg) : std::runtime_error(msg) {}
 };
 
-class OperandStack {
-private:
-    static const size_t          MAX_STACK = 256;
-    std::array<Value, MAX_STACK> stack;
-    int                          top = -1;
+// unwinds run() when the fuel budget runs out. not an error, so it is not a std::exception
+struct Suspended {};
+
+// a call frame. its locals start at base on the task's stack, its operands
+// sit right above them.
+struct Frame {
+    size_t ip = 0;
+    size_t base = 0;
+    size_t locals = 0;
+};
 
+enum class TaskState : uint8_t { READY, RUNNING, WAITING, DONE };
+
+// a green thread: spawn() creates one, yield() and join() switch between them.
+// every frame of a task shares one value stack that starts small and grows on
+// demand, so a task costs a few hundred bytes until it recurses. a pending file
+// operation is a task without frames that the io loop finishes.
+class Task {
 public:
+    static const size_t INITIAL_STACK = 16;
+    static const size_t MAX_STACK     = 1 << 20;  // values, per task
+
+    uint32_t           id;
+    TaskState          state = TaskState::READY;
+    std::vector<Value> stack;
+    std::vector<Frame> frames;
+    size_t             floor = 0;  // first operand slot of the top frame
+    Value              result;     // what the task returned, once done
+    std::string        error;      // set instead of result when a file operation failed
+    std::vector<Task*> joiners;    // tasks waiting in join() for this one
+
+    explicit Task(uint32_t id) : id(id) {
+        stack.reserve(INITIAL_STACK);
+    }
+
     void push(const Value& value) {
-        if (top >= static_cast<int>(MAX_STACK) - 1) {
+        if (stack.size() >= MAX_STACK) {
             throw Error("Stack overflow.");
         }
 
-        stack[++top] = value;
-    }    
+        stack.push_back(value);
+    }
 
     Value pop() {
-        if (top < 0) {
+        if (stack.size() <= floor) {
             throw Error("Stack underflow.");
         }
 
-        return stack[top--];
+        Value v = stack.back();
+        stack.pop_back();
+        return v;
     }
 
-    Value& peek(int distance = 0) {
-        int index = top - distance;
-        if (index < 0) {
+    Value& peek(size_t distance = 0) {
+        if (distance >= stack.size() - floor) {
             throw Error("Stack underflow with peek.");
         }
 
-        return stack[index];
+        return stack[stack.size() - 1 - distance];
+    }
+
+    Value& local(uint16_t index) {
+        const Frame& f = frames.back();
+        if (index >= f.locals) {
+            throw Error("Local variable index out of bounds.");
+        }
+
+        return stack[f.base + index];
     }
 
-    void clear() {
-        top = -1;
+    // the top arg_count operands become the first locals of the new frame
+    void call(size_t ip, size_t arg_count) {
+        if (arg_count > stack.size() - floor) {
+            throw Error("Stack underflow.");
+        }
+
+        frames.push_back({ip, stack.size() - arg_count, arg_count});
+        floor = stack.size();
     }
 
-    bool is_empty() const {
-        return top == -1;
+    // ENTER n, runs before the function pushes anything
+    void reserve_locals(size_t count) {
+        Frame& f = frames.back();
+        if (count <= f.locals) return;
+        if (f.base + count > MAX_STACK) {
+            throw Error("Stack overflow.");
+        }
+
+        stack.resize(f.base + count);
+        f.locals = count;
+        floor = stack.size();
     }
 
-    size_t size() const {
-        return top + 1;
+    // drops the top frame with everything it pushed, returns its return value
+    Value ret() {
+        Value value = pop();
+        stack.resize(frames.back().base);
+        frames.pop_back();
+
+        const Frame& caller = frames.back();
+        floor = caller.base + caller.locals;
+        return value;
     }
+
+    // a finished task only keeps its result
+    void release() {
+        std::vector<Value>().swap(stack);
+        std::vector<Frame>().swap(frames);
+        floor = 0;
+    }
+};
+
+// the progress of a pmap or parallel_for, kept when the vm runs out of fuel in
+// the middle of one. each worker vm keeps its own suspended call.
+struct MapState {
+    struct Claim {
+        size_t next = 0;         // the element being mapped or up next
+        size_t end = 0;          // end of the chunk the worker took
+        bool   in_call = false;  // the worker suspended inside the call for next
+    };
+
+    size_t              ip = 0;  // the instruction that runs again on resume
+    Value               arr;
+    Value               result;
+    size_t              chunk = 0;
+    std::atomic<size_t> next{0};
+    std::vector<Claim>  claims;  // one per worker vm
 };
 
-class Frame {
+// threads that run the worker vms of a pmap, started on first use and kept for
+// the life of the vm so a map in a recursion does not pay for thread creation
+// on every call. thread i runs job(i + 1), the caller runs job(0) itself.
+class MapWorkers {
 private:
-    static const size_t           MAX_LOCALS = 256;
-    std::array<Value, MAX_LOCALS> locals;
-    OperandStack                  op_stack;
-    std::vector<uint8_t>&         bytecode;
-    size_t                        ip = 0;
+    std::mutex               lock;
+    std::condition_variable  work_ready;
+    std::condition_variable  done_ready;
+    std::vector<std::thread> threads;
+    const std::function<void(size_t)>* job = nullptr;
+    uint64_t                 generation = 0;  // bumped for every job
+    size_t                   active = 0;      // threads the current job uses
+    size_t                   running = 0;     // of those, still busy
+    bool                     stopping = false;
+
+    void worker(size_t index) {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            work_ready.wait(guard, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            if (index >= active) continue;
+
+            guard.unlock();
+            (*job)(index + 1);
+            guard.lock();
+
+            if (--running == 0) done_ready.notify_one();
+        }
+    }
 
 public:
-    explicit Frame(std::vector<uint8_t>& bcode) : bytecode(bcode) {}
+    MapWorkers() = default;
+    MapWorkers(const MapWorkers&) = delete;
+    MapWorkers& operator=(const MapWorkers&) = delete;
+
+    ~MapWorkers() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for (auto& t : threads) t.join();
+    }
+
+    // runs job(0) .. job(count - 1) and returns once all of them have, job must not throw
+    void run(size_t count, const std::function<void(size_t)>& fn) {
+        if (count > 1) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                while (threads.size() < count - 1) threads.emplace_back(&MapWorkers::worker, this, threads.size());
+                job = &fn;
+                active = running = count - 1;
+                generation++;
+            }
+            work_ready.notify_all();
+        }
+
+        fn(0);
+
+        if (count > 1) {
+            std::unique_lock<std::mutex> guard(lock);
+            done_ready.wait(guard, [this] { return running == 0; });
+        }
+    }
+};
+
+class CVM {
+private:
+    static const size_t     MAX_GLOBALS = 256;
+    static const size_t     MAX_TRACE = 32;  // callers listed in an error report
+    static constexpr size_t MIN_CHUNK = 256; // elements per pmap work item
+    static constexpr uint64_t FUEL_GRANT = 64; // fuel a pmap worker takes from its parent at a time
+
+public:
+    static const uint64_t   UNLIMITED = UINT64_MAX;
+
+private:
+
+    ProgramRef              program;
+    const Module&           module;     // program's module, shared with every other vm running it
+    Heap                    heap;
+    std::vector<Value>      constants;  // the module's string constants, interned on first use
+    std::vector<std::unique_ptr<Task>> tasks;  // indexed by task id, 0 runs the top level code
+    std::deque<Task*>       run_queue;  // ready tasks, the running one is not in it
+    Task*                   cur_task = nullptr;
+    Frame*                  cur_frame = nullptr;  // top frame of cur_task
+    size_t                  stop_depth = 0;       // invoke() returns once the frames shrink to this
+    IoLoop                  io;
+    size_t                  parallelism = 0;      // worker threads for pmap, 0 = one per core
+    std::vector<std::unique_ptr<CVM>> helpers;   // worker vms for pmap, created on first use
+    MapWorkers              map_workers;          // threads for helpers 1 and up, stopped before the helpers go
+    std::unique_ptr<MapState> pending_map;       // the pmap running, kept when it ran out of fuel
+    std::atomic<uint64_t>*  fuel_pool = nullptr;  // a worker of a budgeted vm draws its fuel here
+    std::shared_ptr<ChannelHub> hub;              // ChannelHub::global() unless the host set one
+    std::vector<std::shared_ptr<Channel>> open_channels;  // indexed by channel handle
+    size_t   channel_stalls = 0;  // tasks parked on a channel since one made progress
+    unsigned stall_spins = 0;
+    NativeRegistryRef       registry;
+    std::vector<const NativeFunction*> natives;  // the module's imports, bound before it runs
+    std::string             snapshot_path;        // where checkpoint() writes, it does nothing when empty
+    bool                    snapshot_written = false;
+    bool                    suspended = false;    // tasks are mid-run, execute() carries on with them
+    uint64_t                fuel = UNLIMITED;     // calls, spawns and channel waits left before suspending
+    uint64_t                executed = 0;         // instructions dispatched by this vm's own thread
+    std::unique_ptr<OpcodeProfile> profile;       // set when profiling, only run_loop<true, ...> touches it
+    std::unique_ptr<StackSampler>  sampler;       // set when sampling, only run_loop<..., true> touches it
+    std::vector<uint32_t>          sample_key;    // reused for every sample
+    Output                  out;
+    std::shared_ptr<OutputSink> diagnostics;  // runtime error reports, stdout when unset
+    const ArrayKernels&     kernels;
+    
+    // debug values
+    bool                    debug = false;
+
+    void report(const std::string& line) {
+        if (!diagnostics) {
+            print(line);
+            return;
+        }
+
+        std::string text = "[cvm] " + line + "\n";
+        diagnostics->write(text.data(), text.size());
+    }
+
+    void collect_garbage() {
+        heap.collect([this](auto&& visit) {
+            for (auto& k : constants) visit(k);
+            for (auto& task : tasks) {
+                for (auto& v : task->stack) visit(v);
+                visit(task->result);
+            }
+            if (pending_map) {
+                visit(pending_map->arr);
+                visit(pending_map->result);
+            }
+        });
+    }
 
     uint8_t readByte() {
-        if (ip >= bytecode.size()) {
+        if (cur_frame->ip >= module.code.size()) {
             throw Error("Unexpected end of bytecode.");
         }
 
-        return bytecode[ip++];
+        return module.code[cur_frame->ip++];
     }
 
-    void enterFunction(size_t n_ip) {
-        ip = n_ip;
-        op_stack.clear();
+    void call_function(size_t bytecode_offset, uint8_t arg_count) {
+        cur_task->call(bytecode_offset, arg_count);
+        cur_frame = &cur_task->frames.back();
     }
 
-    void push(const Value& value) {
-        op_stack.push(value);
+    void resume(Task* task) {
+        task->state = TaskState::RUNNING;
+        cur_task = task;
+        cur_frame = &task->frames.back();
     }
 
-    Value pop() {
-        return op_stack.pop();
+    // finishes the tasks of completed file operations
+    void poll_io(bool wait) {
+        io.reap(wait, [this](IoOp& op) {
+            Task* task = tasks[op.task].get();
+            if (op.error) {
+                task->error = std::string(op.kind == IoOp::Kind::READ ? "read_file" : "write_file") +
+                              "(\"" + op.path + "\"): " + std::strerror(op.error);
+                complete(task, Value());
+            } else if (op.kind == IoOp::Kind::READ) {
+                if (op.data.size() > UINT32_MAX) {
+                    task->error = "read_file(\"" + op.path + "\"): file too large.";
+                    complete(task, Value());
+                    return;
+                }
+                complete(task, Value(heap.make_string(op.data)));
+            } else {
+                complete(task, Value(static_cast<int>(std::min<size_t>(op.done, INT32_MAX))));
+            }
+        });
     }
 
-    Value& peek(int distance = 0) {
-        return op_stack.peek(distance);
+    // switches to the next ready task, waiting for file operations when every
+    // task is parked on one. false when there is nothing left to run
+    bool schedule() {
+        if (io.pending() > 0) poll_io(false);
+        while (run_queue.empty()) {
+            if (io.pending() == 0) return false;
+            poll_io(true);
+        }
+
+        Task* next = run_queue.front();
+        run_queue.pop_front();
+        resume(next);
+        return true;
     }
 
-    void setLocal(uint16_t index, const Value& value) {
-        if (index >= MAX_LOCALS) {
-            throw Error("Local variable index out of bounds.");
+    Task* new_task() {
+        if (tasks.size() > INT32_MAX) {
+            throw Error("Too many tasks.");
         }
 
-        locals[index] = value;
+        tasks.push_back(std::make_unique<Task>(static_cast<uint32_t>(tasks.size())));
+        return tasks.back().get();
     }
 
-    Value getLocal(uint16_t index) {
-        if (index >= MAX_LOCALS) {
-            throw Error("Local variable index out of bounds.");
+    void spawn(size_t bytecode_offset, uint8_t arg_count) {
+        Task* task = new_task();
+        for (int i = arg_count - 1; i >= 0; i--) {
+            task->push(cur_task->peek(i));
         }
+        for (uint8_t i = 0; i < arg_count; i++) {
+            cur_task->pop();
+        }
+        task->frames.push_back({bytecode_offset, 0, arg_count});
+        task->floor = arg_count;
 
-        return locals[index];
+        cur_task->push(Value(static_cast<int>(task->id)));
+        run_queue.push_back(task);
     }
 
-    size_t getIP() const { return ip; }
-    void setIP(size_t v) { ip = v; }
-    bool more_insts() const { return ip < bytecode.size(); } // does the bytecode have more instructions??
+    // looks up every native the module imports once, CALLNATIVE then indexes straight in
+    void bind_natives() {
+        if (natives.size() == module.natives.size()) return;
 
-    Value getResult() {
-        if (op_stack.is_empty()) {
-            throw Error("No result on stack.");
+        if (!registry) {
+            throw Error("Native function '" + module.natives[0].name + "' is not registered.");
+        }
+        natives.clear();
+        for (const auto& import : module.natives) {
+            natives.push_back(&registry->resolve(import));
+        }
+    }
+
+    // no frame: the host reads the arguments where they are, then the result
+    // takes their place
+    void call_native(uint16_t index, uint8_t arg_count) {
+        if (index >= natives.size()) {
+            throw Error("Invalid native function index.");
+        }
+        const NativeFunction& native = *natives[index];
+
+        // the operand count comes from the module, which may not be our compiler's
+        if (arg_count != native.param_types.size()) {
+            throw Error("Native function '" + native.name + "' called with the wrong number of arguments.");
+        }
+        auto& stack = cur_task->stack;
+        if (arg_count > stack.size() - cur_task->floor) {
+            throw Error("Stack underflow.");
+        }
+        NativeArgs args(stack.data() + stack.size() - arg_count, arg_count, heap);
+        Value result = native.fn(args);
+
+        stack.resize(stack.size() - arg_count);
+        if (native.return_type == Type::VOID) return;
+
+        if (result.type != native.return_type) {
+            throw Error("Native function '" + native.name + "' returned the wrong type.");
         }
+        cur_task->push(result);
+    }
 
-        return op_stack.peek();
+    void start_main_task() {
+        bind_natives();
+        tasks.clear();
+        run_queue.clear();
+        pending_map.reset();
+
+        // the top level code has no ENTER, it gets every local slot up front
+        auto main_task = std::make_unique<Task>(0);
+        main_task->stack.resize(MAX_GLOBALS);
+        main_task->frames.push_back({0, 0, MAX_GLOBALS});
+        main_task->floor = MAX_GLOBALS;
+        tasks.push_back(std::move(main_task));
+        resume(tasks.back().get());
     }
-};
 
-class CVM {
-private:
-    std::vector<uint8_t>    bytecode;
-    std::unique_ptr<Frame>  cur_frame;
-    std::vector<std::unique_ptr<Frame>> call_stack;
-    
-    // debug values
-    bool                    debug = false;
+    // calls fn(a[i]) for every element on worker vms, one per thread, each with
+    // its own stack and heap over the shared program. the compiler only lets pure
+    // functions on scalars through, so no heap value crosses between vms and the
+    // workers write straight into distinct elements of the result. the workers of
+    // a budgeted vm share its fuel; once it is gone the vm suspends here and the
+    // map carries on where every worker stopped when it resumes.
+    void parallel_map(const OpCode& op, size_t inst_ip) {
+        const char* name = op == OpCode::PMAP ? "pmap" : "parallel_for";
+        size_t offset = (readByte() << 24) |
+                        (readByte() << 16) |
+                        (readByte() << 8) |
+                        readByte();
+        Type param_type = static_cast<Type>(readByte());
+        Type ret_type = static_cast<Type>(readByte());
+
+        Value arr = cur_task->pop();
+        if ((arr.type != Type::ARRAY && arr.type != Type::VECTOR) || arr.avalue->element_type != param_type) {
+            throw Error(std::string(name) + "() array elements don't match the function's parameter.");
+        }
 
-    void call_function(size_t bytecode_offset) {
-        auto new_frame = std::make_unique<Frame>(bytecode);
-        new_frame->setIP(bytecode_offset);
+        ArrayObject* src = arr.avalue;
+        size_t n = src->length;
+
+        if (!pending_map || pending_map->ip != inst_ip || pending_map->arr.avalue != src) {
+            auto map = std::make_unique<MapState>();
+            map->ip = inst_ip;
+            map->arr = arr;
+            map->result = arr;
+            if (op == OpCode::PMAP) {
+                ArrayObject* dst = heap.make_array(ret_type, std::max<uint32_t>(src->length, 1));
+                heap.resize(dst, src->length);
+                map->result = Value(arr.type, dst);
+            }
+
+            size_t workers = parallelism ? parallelism : std::max(1u, std::thread::hardware_concurrency());
+            workers = std::max<size_t>(1, std::min(workers, (n + MIN_CHUNK - 1) / MIN_CHUNK));
 
-        uint8_t param_count = new_frame->readByte();
-        for (int i = param_count - 1; i >= 0; i--) {
-            Value arg = call_stack.back()->pop();
-            new_frame->setLocal(i, arg);
+            // chunks are handed out from a shared counter so uneven calls balance out
+            map->chunk = std::max(MIN_CHUNK, n / (workers * 8));
+            map->claims.resize(workers);
+            pending_map = std::move(map);
         }
 
-        call_stack.push_back(std::move(new_frame));
+        MapState& map = *pending_map;
+        ArrayObject* dst = map.result.avalue;
+        size_t workers = map.claims.size();
+
+        while (helpers.size() < workers) {
+            auto helper = std::make_unique<CVM>(program, false, heap.configuration());
+            helper->parallelism = 1;
+            helper->registry = registry;
+            helper->natives = natives;
+            helper->set_diagnostics(std::make_shared<MemorySink>());
+            helpers.push_back(std::move(helper));
+        }
+
+        std::atomic<uint64_t> pool{fuel};
+        for (size_t i = 0; i < workers; i++) {
+            helpers[i]->fuel = fuel == UNLIMITED ? UNLIMITED : 0;
+            helpers[i]->fuel_pool = fuel == UNLIMITED ? nullptr : &pool;
+        }
+
+        std::atomic<bool> failed{false};
+        std::atomic<bool> starved{false};
+        std::exception_ptr error;
+        std::mutex error_lock;
+
+        std::function<void(size_t)> work = [&](size_t w) {
+            CVM& vm = *helpers[w];
+            MapState::Claim& c = map.claims[w];
+            try {
+                for (;;) {
+                    if (c.next == c.end) {
+                        if (failed.load(std::memory_order_relaxed)) return;
+                        size_t begin = map.next.fetch_add(map.chunk);
+                        if (begin >= n) return;
+                        c.next = begin;
+                        c.end = std::min(n, begin + map.chunk);
+                    }
+
+                    Value r = c.in_call ? vm.finish_invoke() : vm.invoke(offset, src->get(c.next));
+                    c.in_call = false;
+                    if (ret_type == Type::INT) dst->buffer->ints()[c.next] = r.ivalue;
+                    else dst->buffer->bools()[c.next] = r.bvalue;
+                    c.next++;
+                }
+            } catch (const Suspended&) {
+                c.in_call = true;
+                starved = true;
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(error_lock);
+                if (!error) error = std::current_exception();
+                failed = true;
+            }
+        };
+
+        map_workers.run(workers, work);
+
+        // grants the workers did not use go back to this vm
+        if (fuel != UNLIMITED) {
+            uint64_t left = pool.load();
+            for (size_t i = 0; i < workers; i++) left += helpers[i]->fuel;
+            fuel = left;
+        }
+        for (size_t i = 0; i < workers; i++) helpers[i]->fuel_pool = nullptr;
+
+        if (error) {
+            pending_map.reset();
+            std::rethrow_exception(error);
+        }
+        if (starved) {
+            cur_task->push(arr);
+            suspend(inst_ip);
+        }
+
+        cur_task->push(map.result);
+        pending_map.reset();
+    }
+
+    // runs the function at bytecode_offset on arg to completion, on this vm's own
+    // main task. used by the worker vms of parallel_map
+    Value invoke(size_t bytecode_offset, const Value& arg) {
+        // an error or an abandoned suspension leaves the frames of the call behind
+        if (tasks.empty() || tasks[0]->frames.size() != 1) start_main_task();
+
+        cur_task->push(arg);
+        call_function(bytecode_offset, 1);
+        return finish_invoke();
+    }
+
+    // carries on with the call invoke() started. throws Suspended when the vm
+    // runs out of fuel first, the call stays for the next finish_invoke()
+    Value finish_invoke() {
+        suspended = false;
+        stop_depth = 1;
+        run();
+        stop_depth = 0;
+        if (suspended) throw Suspended();
+        return cur_task->pop();
+    }
+
+    Channel& channel_at(const Value& handle) {
+        if (handle.type != Type::INT || handle.ivalue < 0 || static_cast<size_t>(handle.ivalue) >= open_channels.size()) {
+            throw Error("Expected a channel handle.");
+        }
+        return *open_channels[handle.ivalue];
+    }
+
+    void open_channel() {
+        Value name = cur_task->pop();
+        if (name.type != Type::STRING) throw Error("channel() expects a name.");
+        if (!hub) hub = ChannelHub::global();
+
+        open_channels.push_back(hub->open(std::string(flatten(heap, name.svalue)->view())));
+        cur_task->push(Value(static_cast<int>(open_channels.size() - 1)));
+    }
+
+    // strings are frozen on the way out, that copies them at most once
+    Message to_message(const Value& v) {
+        Message m;
+        m.type = v.type;
+        switch (v.type) {
+            case Type::INT:    m.ivalue = v.ivalue; break;
+            case Type::BOOL:   m.bvalue = v.bvalue; break;
+            case Type::STRING: m.svalue = freeze(heap, v.svalue); break;
+            default: throw Error("Only int, bool and string values can be sent.");
+        }
+        return m;
+    }
+
+    // a frozen string is used as is, the heap just keeps a reference to it
+    Value from_message(const Message& m) {
+        switch (m.type) {
+            case Type::INT:    return Value(m.ivalue);
+            case Type::BOOL:   return Value(m.bvalue);
+            default:           return Value(heap.adopt_frozen(m.svalue));
+        }
+    }
+
+    // jumps only go forward, so a script can only keep running by calling,
+    // spawning or waiting on a channel; each of those burns one unit of fuel
+    bool out_of_fuel() {
+        if (fuel == UNLIMITED) return false;
+        if (fuel == 0 && !draw_fuel()) return true;
+        fuel--;
+        return false;
+    }
+
+    // a pmap worker of a budgeted vm takes its fuel from the parent a grant at a time
+    bool draw_fuel() {
+        if (!fuel_pool) return false;
+
+        uint64_t left = fuel_pool->load(std::memory_order_relaxed);
+        uint64_t grant;
+        do {
+            if (left == 0) return false;
+            grant = std::min(left, FUEL_GRANT);
+        } while (!fuel_pool->compare_exchange_weak(left, left - grant, std::memory_order_relaxed));
+
+        fuel = grant;
+        return true;
+    }
+
+    // the instruction at inst_ip has not done anything yet, it runs again on resume
+    [[noreturn]] void suspend(size_t inst_ip) {
+        cur_frame->ip = inst_ip;
+        throw Suspended();
+    }
+
+    static void backoff(unsigned& spins) {
+        if (++spins < 64) std::this_thread::yield();
+        else std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+
+    // a full or empty channel. when other tasks can run, the operands stay on
+    // the stack and the instruction is retried after their turn; otherwise this
+    // thread waits for the vm on the other end, or suspends once a budgeted vm
+    // has burnt its fuel waiting. once every ready task has parked
+    // in a row the thread backs off as well, or tasks waiting on each other
+    // through another vm would keep passing the turn around and starve it.
+    void park_on_channel(size_t inst_ip) {
+        if (out_of_fuel()) suspend(inst_ip);
+        if (++channel_stalls > run_queue.size()) backoff(stall_spins);
+
+        cur_frame->ip = inst_ip;
+        yield();
+    }
+
+    void channel_progress() {
+        channel_stalls = 0;
+        stall_spins = 0;
+    }
+
+    void channel_send(size_t inst_ip) {
+        Value v = cur_task->peek();
+        Channel& ch = channel_at(cur_task->peek(1));
+
+        Message m = to_message(v);
+        for (unsigned spins = 0; !ch.try_send(m);) {
+            // parking or suspending retries the whole send, the message goes
+            if (!run_queue.empty() || out_of_fuel()) {
+                if (m.type == Type::STRING) release_frozen(m.svalue);
+                if (run_queue.empty()) suspend(inst_ip);
+                park_on_channel(inst_ip);
+                return;
+            }
+            backoff(spins);
+        }
+
+        channel_progress();
+        cur_task->pop();
+        cur_task->pop();
+    }
+
+    void channel_recv(size_t inst_ip) {
+        Channel& ch = channel_at(cur_task->peek());
+
+        Message m;
+        for (unsigned spins = 0; !ch.try_recv(m);) {
+            if (!run_queue.empty()) {
+                park_on_channel(inst_ip);
+                return;
+            }
+            if (out_of_fuel()) suspend(inst_ip);
+            backoff(spins);
+        }
+
+        channel_progress();
+        cur_task->pop();
+        cur_task->push(from_message(m));
+    }
+
+    void channel_try_recv() {
+        Value fallback = cur_task->pop();
+        Channel& ch = channel_at(cur_task->pop());
+
+        Message m;
+        cur_task->push(ch.try_recv(m) ? from_message(m) : fallback);
+    }
+
+    // read_file(path) and write_file(path, text) start the operation and push a
+    // handle; join() on it parks until the io loop has finished it
+    void start_io(IoOp::Kind kind) {
+        std::string text;
+        if (kind == IoOp::Kind::WRITE) {
+            Value v = cur_task->pop();
+            if (v.type != Type::STRING) throw Error("write_file() expects a string.");
+            text.resize(v.svalue->length);
+            copy_chars(v.svalue, text.data());
+        }
+
+        Value path = cur_task->pop();
+        if (path.type != Type::STRING) throw Error("Expected a file path.");
+
+        Task* task = new_task();
+        task->state = TaskState::WAITING;
+
+        auto op = std::make_unique<IoOp>(kind, task->id, std::string(flatten(heap, path.svalue)->view()));
+        op->data = std::move(text);
+        io.submit(std::move(op));
+
+        cur_task->push(Value(static_cast<int>(task->id)));
+    }
+
+    // marks task done and wakes whoever joined it
+    void complete(Task* task, const Value& result) {
+        task->state = TaskState::DONE;
+        task->result = result;
+
+        for (Task* waiter : task->joiners) {
+            waiter->state = TaskState::READY;
+            run_queue.push_back(waiter);
+        }
+        task->joiners.clear();
+    }
+
+    // the running task is done, moves on to the next one. false once no task
+    // is left to run
+    bool finish_task(const Value& result) {
+        Task* task = cur_task;
+        complete(task, result);
+
+        // the top level task keeps its stack for getResult()
+        if (task->id != 0) task->release();
+        return schedule();
+    }
+
+    // join() of a task that is not done parks the caller. it is woken when the
+    // task finishes and runs the JOIN again, which then finds the result
+    void join(size_t inst_ip) {
+        Value handle = cur_task->pop();
+        if (handle.type != Type::INT || handle.ivalue < 0 || static_cast<size_t>(handle.ivalue) >= tasks.size()) {
+            throw Error("join() expects a task handle.");
+        }
+
+        Task* task = tasks[handle.ivalue].get();
+        if (task->state == TaskState::DONE) {
+            if (!task->error.empty()) throw Error(task->error);
+            cur_task->push(task->result);
+            return;
+        }
+
+        if (task == cur_task) {
+            throw Error("A task cannot join itself.");
+        }
+
+        cur_task->push(handle);
+        cur_frame->ip = inst_ip;
+        cur_task->state = TaskState::WAITING;
+        task->joiners.push_back(cur_task);
+
+        if (!schedule()) {
+            throw Error("Deadlock, every task is waiting in join().");
+        }
+    }
+
+    void yield() {
+        if (io.pending() > 0) poll_io(false);
+        if (run_queue.empty()) return;
+
+        cur_task->state = TaskState::READY;
+        run_queue.push_back(cur_task);
+        schedule();
     }
 
     void unary(const OpCode& op) {
-        Value a = cur_frame->pop();
+        Value a = cur_task->pop();
         Value result;
 
         switch (op) {
@@ -204,30 +860,36 @@ private:
                 throw Error("Unknown unary operator.");
         }
 
-        cur_frame->push(result);
+        cur_task->push(result);
     }
 
     void comparison(const OpCode& op) {
-        Value b = cur_frame->pop();
-        Value a = cur_frame->pop();
+        Value b = cur_task->pop();
+        Value a = cur_task->pop();
 
         if (a.type == Type::STRING || b.type == Type::STRING) {
             if (op != OpCode::EQ && op != OpCode::NEQ) {
                 throw Error("Only equality comparisons are supported for strings.");
             }
 
-            std::string str_a, str_b;
-            
-            if (a.type == Type::STRING) str_a = *a.svalue;
-            else if (a.type == Type::INT) str_a = std::to_string(a.ivalue);
-            else if (a.type == Type::BOOL) str_a = (a.bvalue ? "true" : "false");
-            
-            if (b.type == Type::STRING) str_b = *b.svalue;
-            else if (b.type == Type::INT) str_b = std::to_string(b.ivalue);
-            else if (b.type == Type::BOOL) str_b = (b.bvalue ? "true" : "false");
+            if (a.type == Type::STRING && b.type == Type::STRING) {
+                bool equal = string_equals(heap, a.svalue, b.svalue);
+                cur_task->push(Value(op == OpCode::EQ ? equal : !equal));
+                return;
+            }
+
+            // non strings compare by their text, formatted into small stack buffers
+            char buf_a[16], buf_b[16];
+            std::string_view str_a, str_b;
+
+            if (a.type == Type::STRING) str_a = flatten(heap, a.svalue)->view();
+            else str_a = std::string_view(buf_a, write_text(a, buf_a) - buf_a);
+
+            if (b.type == Type::STRING) str_b = flatten(heap, b.svalue)->view();
+            else str_b = std::string_view(buf_b, write_text(b, buf_b) - buf_b);
 
             bool result = (op == OpCode::EQ) ? (str_a == str_b) : (str_a != str_b);
-            cur_frame->push(Value(result));
+            cur_task->push(Value(result));
             return;
         }
 
@@ -246,26 +908,16 @@ private:
             default: throw Error("Unknown comparison operator.");
         }
 
-        cur_frame->push(Value(result));
+        cur_task->push(Value(result));
     }
 
 
     void binary(const OpCode& op) {
-        Value b = cur_frame->pop();
-        Value a = cur_frame->pop();
+        Value b = cur_task->pop();
+        Value a = cur_task->pop();
         
         if (op == OpCode::ADD && (a.type == Type::STRING || b.type == Type::STRING)) {
-            std::string result;
-            
-            if (a.type == Type::STRING) result += *a.svalue;
-            else if (a.type == Type::INT) result += std::to_string(a.ivalue);
-            else if (a.type == Type::BOOL) result += (a.bvalue ? "true" : "false");
-            
-            if (b.type == Type::STRING) result += *b.svalue;
-            else if (b.type == Type::INT) result += std::to_string(b.ivalue);
-            else if (b.type == Type::BOOL) result += (b.bvalue ? "true" : "false");
-            
-            cur_frame->push(Value(result));
+            cur_task->push(Value(concat(heap, a, b)));
             return;
         }
         
@@ -283,7 +935,135 @@ private:
             default: throw Error("Unknown binary operator.");
         }
 
-        cur_frame->push(result);
+        cur_task->push(result);
+    }
+
+    static ArrayObject* int_array(const Value& v, const char* name) {
+        if ((v.type != Type::ARRAY && v.type != Type::VECTOR) || v.avalue->element_type != Type::INT) {
+            throw Error(std::string(name) + "() expects an int array.");
+        }
+        return v.avalue;
+    }
+
+    static int int_arg(const Value& v, const char* name) {
+        if (v.type != Type::INT) {
+            throw Error(std::string(name) + "() expects an int value.");
+        }
+        return v.ivalue;
+    }
+
+    // the array builtins work on the raw int32 buffer through the simd kernels
+    void array_builtin(const OpCode& op) {
+        switch (op) {
+            case OpCode::ASUM:
+            case OpCode::AMIN:
+            case OpCode::AMAX: {
+                const char* name = op == OpCode::ASUM ? "sum" : op == OpCode::AMIN ? "min" : "max";
+                ArrayObject* a = int_array(cur_task->pop(), name);
+                const int32_t* data = a->buffer->ints();
+
+                if (op == OpCode::ASUM) {
+                    cur_task->push(Value(static_cast<int>(kernels.sum(data, a->length))));
+                    return;
+                }
+
+                if (a->length == 0) {
+                    throw Error(std::string(name) + "() of an empty array.");
+                }
+
+                int32_t r = op == OpCode::AMIN ? kernels.min(data, a->length) : kernels.max(data, a->length);
+                cur_task->push(Value(static_cast<int>(r)));
+                return;
+            }
+            case OpCode::AFIND:
+            case OpCode::ACOUNT:
+            case OpCode::AFILL: {
+                const char* name = op == OpCode::AFIND ? "indexOf" : op == OpCode::ACOUNT ? "count" : "fill";
+                int x = int_arg(cur_task->pop(), name);
+                Value arr = cur_task->pop();
+                ArrayObject* a = int_array(arr, name);
+                int32_t* data = a->buffer->ints();
+
+                if (op == OpCode::AFILL) {
+                    kernels.fill(data, a->length, x);
+                    cur_task->push(arr);
+                } else if (op == OpCode::AFIND) {
+                    size_t i = kernels.index_of(data, a->length, x);
+                    cur_task->push(Value(i == a->length ? -1 : static_cast<int>(i)));
+                } else {
+                    cur_task->push(Value(static_cast<int>(kernels.count(data, a->length, x))));
+                }
+                return;
+            }
+            case OpCode::AADD:
+            case OpCode::AMUL: {
+                const char* name = op == OpCode::AADD ? "add" : "mul";
+                Value b = cur_task->pop();
+                Value arr = cur_task->pop();
+                ArrayObject* a = int_array(arr, name);
+                int32_t* data = a->buffer->ints();
+
+                if (b.type == Type::INT) {
+                    if (op == OpCode::AADD) kernels.add(data, a->length, b.ivalue);
+                    else kernels.mul(data, a->length, b.ivalue);
+                } else {
+                    ArrayObject* other = int_array(b, name);
+                    if (other->length != a->length) {
+                        throw Error(std::string(name) + "() arrays differ in size.");
+                    }
+
+                    if (op == OpCode::AADD) kernels.add_array(data, other->buffer->ints(), a->length);
+                    else kernels.mul_array(data, other->buffer->ints(), a->length);
+                }
+
+                cur_task->push(arr);
+                return;
+            }
+            default:
+                throw Error("Unknown array builtin.");
+        }
+    }
+
+    Value load_element(const Value& arr, const Value& idx) {
+        if (idx.type != Type::INT) {
+            throw Error("Array index must be a numeric literal.");
+        }
+
+        if (arr.type == Type::ARRAY) {
+            return arr.avalue->get(idx.ivalue);
+        } else if (arr.type == Type::VECTOR) {
+            if (static_cast<size_t>(idx.ivalue) >= arr.vvalue->size()) {
+                throw Error("Vector index out of bounds");
+            }
+            return arr.vvalue->get(idx.ivalue);
+        }
+
+        throw Error("Cannot index non-array type.");
+    }
+
+    void store_element(const Value& arr, const Value& idx, const Value& value) {
+        if (idx.type != Type::INT) {
+            throw Error("Array index must be a numeric literal.");
+        }
+
+        if (arr.type != Type::ARRAY && arr.type != Type::VECTOR) {
+            throw Error("Cannot index non-array type.");
+        }
+
+        ArrayObject* a = arr.avalue;
+        size_t index = static_cast<size_t>(idx.ivalue);
+        if (value.type != a->element_type) {
+            throw Error(arr.type == Type::ARRAY ? "Type mismatch in array assignment"
+                                                : "Type mismatch in vector assignment");
+        }
+
+        if (index >= a->length) {
+            // vectors grow to fit, arrays are fixed once built
+            if (arr.type == Type::ARRAY) throw Error("Array index out of bounds");
+            heap.resize(a, index + 1);
+        }
+
+        heap.set(a, index, value);
     }
 
     void debug_stack() {
@@ -293,7 +1073,7 @@ private:
         try {
             for (size_t i = 0; i < 4; i++) {
                 try {
-                    Value val = cur_frame->peek(i);
+                    Value val = cur_task->peek(i);
                     print("     " + std::to_string(val.ivalue) + ",");
                 } catch (const Error& e) {
                     break;
@@ -313,84 +1093,513 @@ private:
     void print_value(const Value& value) {
         switch (value.type) {
             case Type::INT:
-                std::cout << value.ivalue;
+                out.write(value.ivalue);
                 break;
             case Type::BOOL:
-                std::cout << (value.bvalue ? "true" : "false");
+                out.write(value.bvalue ? "true" : "false");
                 break;
             case Type::STRING:
-                std::cout << *value.svalue;
+                // ropes are written piece by piece, no need to flatten them
+                each_piece(value.svalue, [this](std::string_view piece) {
+                    out.write(piece.data(), piece.size());
+                });
                 break;
             case Type::ARRAY:
-                std::cout << &value.avalue;
-                break;
-            case Type::VECTOR:
-                std::cout << &value.vvalue;
+            case Type::VECTOR: {
+                const ArrayObject* arr = value.avalue;
+                out.write('{');
+                for (size_t i = 0; i < arr->length; i++) {
+                    if (i > 0) out.write(", ", 2);
+                    print_value(arr->get(i));
+                }
+                out.write('}');
                 break;
+            }
             case Type::VOID:
               break;
             }
-        std::cout << std::endl;
+    }
+
+    // writes all print() arguments as one space separated line
+    void print_values(uint8_t count) {
+        for (int i = count - 1; i >= 0; i--) {
+            print_value(cur_task->peek(i));
+            if (i > 0) out.write(' ');
+        }
+        out.write('\n');
+        out.end_record();
+
+        for (uint8_t i = 0; i < count; i++) {
+            cur_task->pop();
+        }
+    }
+
+    void write_value(SnapshotWriter& w, const Value& v,
+                     const std::unordered_map<const Obj*, uint32_t>& ids) const {
+        w.u8(static_cast<uint8_t>(v.type));
+        switch (v.type) {
+            case Type::INT:  w.u32(static_cast<uint32_t>(v.ivalue)); break;
+            case Type::BOOL: w.u8(v.bvalue ? 1 : 0); break;
+            case Type::VOID: break;
+            default:         w.u32(ids.at(v.obj())); break;
+        }
+    }
+
+    Value read_value(SnapshotReader& r, const std::vector<StringObject*>& strings,
+                     const std::vector<ArrayObject*>& arrays) const {
+        Value v;
+        v.type = r.type();
+        switch (v.type) {
+            case Type::INT:  v.ivalue = static_cast<int>(r.u32()); break;
+            case Type::BOOL: v.bvalue = r.u8() != 0; break;
+            case Type::VOID: break;
+            case Type::STRING: {
+                uint32_t id = r.u32();
+                if (id >= strings.size()) throw Error("Invalid string in snapshot.");
+                v.svalue = strings[id];
+                break;
+            }
+            default: {
+                uint32_t id = r.u32();
+                if (id >= arrays.size()) throw Error("Invalid array in snapshot.");
+                v.avalue = arrays[id];
+                break;
+            }
+        }
+        return v;
+    }
+
+    // rebuilds the heap objects and tasks written by snapshot(). every object is
+    // allocated afresh, strings that were interned are interned again.
+    void load_snapshot(SnapshotReader& r) {
+        std::vector<StringObject*> strings(r.u32());
+        for (auto& s : strings) {
+            bool interned = r.u8() != 0;
+            std::string_view text = r.bytes(r.u32());
+            s = interned ? heap.intern(text) : heap.make_string(text);
+        }
+
+        std::vector<ArrayObject*> arrays(r.u32());
+        for (auto& a : arrays) {
+            Type element_type = r.type();
+            uint32_t length = r.u32();
+            if (element_type != Type::INT && element_type != Type::BOOL && element_type != Type::STRING) {
+                throw Error("Invalid array in snapshot.");
+            }
+            r.need(static_cast<size_t>(length) * (element_type == Type::BOOL ? 1 : 4));
+
+            a = heap.make_array(element_type, std::max<uint32_t>(length, 1));
+            heap.resize(a, length);
+            for (uint32_t i = 0; i < length; i++) {
+                if (element_type == Type::INT) {
+                    a->buffer->ints()[i] = static_cast<int32_t>(r.u32());
+                } else if (element_type == Type::BOOL) {
+                    a->buffer->bools()[i] = r.u8() != 0;
+                } else {
+                    uint32_t id = r.u32();
+                    if (id == SNAPSHOT_NULL) continue;
+                    if (id >= strings.size()) throw Error("Invalid string in snapshot.");
+                    heap.set(a, i, Value(strings[id]));
+                }
+            }
+        }
+
+        // the top level code runs up to its HALT, the function bodies follow it
+        size_t top_end = module.code.size();
+        for (const auto& f : module.functions) top_end = std::min<size_t>(top_end, f.offset);
+
+        tasks.clear();
+        run_queue.clear();
+        uint32_t count = r.u32();
+        uint32_t running = r.u32();
+        if (count == 0 || running >= count) {
+            throw Error("Invalid tasks in snapshot.");
+        }
+        for (uint32_t i = 0; i < count; i++) tasks.push_back(std::make_unique<Task>(i));
+
+        auto task_at = [&](uint32_t id) {
+            if (id >= count) throw Error("Invalid task in snapshot.");
+            return tasks[id].get();
+        };
+
+        for (auto& task : tasks) {
+            uint8_t state = r.u8();
+            if (state > static_cast<uint8_t>(TaskState::DONE)) throw Error("Invalid task in snapshot.");
+            task->state = static_cast<TaskState>(state);
+            task->floor = r.u32();
+
+            uint32_t n = r.u32();
+            r.need(n);
+            task->stack.reserve(n);
+            for (uint32_t i = 0; i < n; i++) task->stack.push_back(read_value(r, strings, arrays));
+
+            n = r.u32();
+            r.need(static_cast<size_t>(n) * 12);
+            for (uint32_t i = 0; i < n; i++) {
+                Frame f;
+                f.ip = r.u32();
+                f.base = r.u32();
+                f.locals = r.u32();
+                if (f.ip > module.code.size() || f.base + f.locals > task->stack.size()) {
+                    throw Error("Invalid frame in snapshot.");
+                }
+                task->frames.push_back(f);
+            }
+            if (task->floor > task->stack.size()) throw Error("Invalid task in snapshot.");
+
+            // a task that still runs resumes every frame: the top level one before
+            // the HALT, the others inside a function body
+            if (task->state != TaskState::DONE) {
+                for (size_t i = 0; i < task->frames.size(); i++) {
+                    bool top_level = task->id == 0 && i == 0;
+                    size_t ip = task->frames[i].ip;
+                    if (top_level ? ip >= top_end : ip < top_end || ip >= module.code.size()) {
+                        throw Error("Invalid frame in snapshot.");
+                    }
+                }
+            }
+
+            task->result = read_value(r, strings, arrays);
+            task->error = std::string(r.bytes(r.u32()));
+
+            n = r.u32();
+            for (uint32_t i = 0; i < n; i++) task->joiners.push_back(task_at(r.u32()));
+        }
+
+        uint32_t queued = r.u32();
+        for (uint32_t i = 0; i < queued; i++) run_queue.push_back(task_at(r.u32()));
+
+        if (!r.at_end()) {
+            throw Error("Trailing data in snapshot.");
+        }
+        if (tasks[running]->frames.empty() || tasks[running]->state == TaskState::DONE ||
+            tasks[0]->state == TaskState::DONE) {
+            throw Error("Invalid tasks in snapshot.");
+        }
+
+        resume(tasks[running].get());
+        suspended = true;
+    }
+
+    // checkpoint(): writes a snapshot when the host asked for one and stops the vm
+    bool checkpoint() {
+        if (snapshot_path.empty()) return false;
+
+        std::vector<uint8_t> data = snapshot();
+        std::ofstream file(snapshot_path, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(data.data()), data.size());
+        if (!file.good()) {
+            throw Error("could not write snapshot '" + snapshot_path + "'");
+        }
+
+        snapshot_written = true;
+        return true;
     }
 
 public:
-    CVM(const std::vector<uint8_t>& bcode, bool debug = false)
-        : bytecode(bcode), debug(debug) {
-        
-        call_stack.push_back(std::make_unique<Frame>(bytecode));
+    // a vm is cheap to create: it shares the program and only owns its heap,
+    // frames and output
+    CVM(ProgramRef prog, bool debug = false, const HeapConfig& heap_config = HeapConfig())
+        : program(std::move(prog)), module(program->module()), heap(heap_config),
+          kernels(array_kernels()), debug(debug) {
+        // ints until PUSHS interns them, so unused constants cost nothing
+        constants.resize(module.constants.size());
+
+        // keep script output interleaved with the debug trace
+        if (debug) {
+            out.set_policy(FlushPolicy::LINE);
+            print(std::string("array kernels: ") + kernels.name);
+        }
+    }
+
+    // runs a private copy of mod
+    CVM(const Module& mod, bool debug = false, const HeapConfig& heap_config = HeapConfig())
+        : CVM(make_program(mod), debug, heap_config) {}
+
+    Output& output() { return out; }
+    void set_diagnostics(std::shared_ptr<OutputSink> sink) { diagnostics = std::move(sink); }
+    const GCStats& gc_stats() const { return heap.statistics(); }
+    const PoolStats& pool_stats() const { return heap.pool_statistics(); }
+
+    void set_parallelism(size_t workers) { parallelism = workers; }
+    void set_channels(std::shared_ptr<ChannelHub> channels) { hub = std::move(channels); }
+
+    // the host functions the program was compiled against, before execute()
+    void set_natives(NativeRegistryRef natives_registry) {
+        registry = std::move(natives_registry);
+        natives.clear();
     }
 
-    void execute() {
-        cur_frame = std::make_unique<Frame>(bytecode);
+    // checkpoint() in the script writes a snapshot to path and stops the vm there
+    void set_snapshot_path(std::string path) { snapshot_path = std::move(path); }
+    bool wrote_snapshot() const { return snapshot_written; }
+
+    // the whole state of a vm that is not running: its module, every string and
+    // array its tasks can reach, and the tasks with their stacks, frames and run
+    // queue. channels and file operations in flight belong to the process and
+    // cannot be captured, so a vm holding either refuses, and so does one that
+    // ran out of fuel inside a pmap, whose progress lives in its worker vms.
+    std::vector<uint8_t> snapshot() {
+        if (tasks.empty()) {
+            throw Error("Nothing to snapshot.");
+        }
+        // the top level code has halted, a restored vm would run on past HALT
+        if (tasks[0]->state == TaskState::DONE) {
+            throw Error("Cannot snapshot a vm that has finished.");
+        }
+        if (io.pending() > 0) {
+            throw Error("Cannot snapshot while file operations are in flight.");
+        }
+        if (!open_channels.empty()) {
+            throw Error("Cannot snapshot a vm with open channels.");
+        }
+        if (pending_map) {
+            throw Error("Cannot snapshot a vm suspended inside pmap or parallel_for.");
+        }
+
+        // number every reachable string and array, shared ones are written once
+        std::unordered_map<const Obj*, uint32_t> ids;
+        std::vector<StringObject*> strings;
+        std::vector<ArrayObject*> arrays;
+
+        auto note_string = [&](StringObject* s) {
+            if (s && ids.emplace(s, strings.size()).second) strings.push_back(s);
+        };
+        auto note = [&](const Value& v) {
+            if (v.type == Type::STRING) {
+                note_string(v.svalue);
+            } else if (v.type == Type::ARRAY || v.type == Type::VECTOR) {
+                ArrayObject* a = v.avalue;
+                if (!ids.emplace(a, arrays.size()).second) return;
+                arrays.push_back(a);
+                if (a->element_type != Type::STRING) return;
+                for (uint32_t i = 0; i < a->length; i++) note_string(a->buffer->strings()[i]);
+            }
+        };
+        for (auto& task : tasks) {
+            for (auto& v : task->stack) note(v);
+            note(task->result);
+        }
+
+        SnapshotWriter w;
+        w.bytes(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        w.u16(SNAPSHOT_VERSION);
+
+        std::vector<uint8_t> mod = ModuleWriter().write(module);
+        w.size(mod.size());
+        w.bytes(mod.data(), mod.size());
+
+        // ropes are written flat
+        w.size(strings.size());
+        for (StringObject* s : strings) {
+            w.u8(s->flags & OBJ_INTERNED ? 1 : 0);
+            w.size(s->length);
+            each_piece(s, [&](std::string_view piece) { w.bytes(piece.data(), piece.size()); });
+        }
+
+        w.size(arrays.size());
+        for (ArrayObject* a : arrays) {
+            w.u8(static_cast<uint8_t>(a->element_type));
+            w.size(a->length);
+            for (uint32_t i = 0; i < a->length; i++) {
+                switch (a->element_type) {
+                    case Type::INT:  w.u32(static_cast<uint32_t>(a->buffer->ints()[i])); break;
+                    case Type::BOOL: w.u8(a->buffer->bools()[i]); break;
+                    default: {
+                        StringObject* s = a->buffer->strings()[i];
+                        w.u32(s ? ids.at(s) : SNAPSHOT_NULL);
+                        break;
+                    }
+                }
+            }
+        }
+
+        w.size(tasks.size());
+        w.u32(cur_task->id);
+        for (auto& task : tasks) {
+            w.u8(static_cast<uint8_t>(task->state));
+            w.size(task->floor);
+            w.size(task->stack.size());
+            for (auto& v : task->stack) write_value(w, v, ids);
+            w.size(task->frames.size());
+            for (const Frame& f : task->frames) {
+                w.size(f.ip);
+                w.size(f.base);
+                w.size(f.locals);
+            }
+            write_value(w, task->result, ids);
+            w.size(task->error.size());
+            w.bytes(task->error.data(), task->error.size());
+            w.size(task->joiners.size());
+            for (Task* t : task->joiners) w.u32(t->id);
+        }
+
+        w.size(run_queue.size());
+        for (Task* t : run_queue) w.u32(t->id);
+        return w.finish();
+    }
+
+    // a vm that carries on from a snapshot, execute() resumes it. only the module
+    // bytes are copied out of data, the heap is rebuilt from it directly.
+    static std::unique_ptr<CVM> restore(const uint8_t* data, size_t size, bool debug = false,
+                                        const HeapConfig& heap_config = HeapConfig()) {
+        SnapshotReader r(data, size);
+        r.open();
+
+        std::string_view mod = r.bytes(r.u32());
+        std::vector<uint8_t> raw(mod.begin(), mod.end());
+        auto vm = std::make_unique<CVM>(make_program(ModuleReader(raw).read()), debug, heap_config);
+        vm->load_snapshot(r);
+        return vm;
+    }
+
+    static std::unique_ptr<CVM> restore(const std::string& path, bool debug = false,
+                                        const HeapConfig& heap_config = HeapConfig()) {
+        MappedFile file(path);
+        return restore(file.data(), file.size(), debug, heap_config);
+    }
+
+    // fuel is spent one unit per call, spawn and channel wait. a vm that runs
+    // out stops at that instruction and keeps all of its state; give it more
+    // fuel and execute() again to carry on. UNLIMITED turns the budget off.
+    void set_fuel(uint64_t units) { fuel = units; }
+    uint64_t fuel_left() const { return fuel; }
+
+    // instructions run so far, over every execute(). pmap workers keep their own count.
+    uint64_t instructions() const { return executed; }
+
+    // records per opcode counts, ticks and pairs from the next execute() on,
+    // see profiler.hpp. pmap workers are not profiled.
+    void set_profiling(bool on) {
+        if (!on) profile.reset();
+        else if (!profile) profile = std::make_unique<OpcodeProfile>();
+    }
+    const OpcodeProfile* opcode_profile() const { return profile.get(); }
+
+    // samples the running task's call stack every interval from the next
+    // execute() on, see StackSampler. a zero interval turns it off.
+    void set_sampling(std::chrono::microseconds interval) {
+        if (interval.count() > 0) sampler = std::make_unique<StackSampler>(interval);
+        else sampler.reset();
+    }
+    const StackSampler* stack_sampler() const { return sampler.get(); }
+
+    // the folded stacks sampled so far, function names and lines from this vm's module
+    void write_samples(std::ostream& out) const {
+        if (sampler) sampler->write_folded(out, module);
+    }
+
+    // runs the program, or carries on with a suspended or restored one. false
+    // when the vm ran out of fuel before finishing.
+    bool execute() {
+        if (suspended) {
+            suspended = false;
+            bind_natives();
+        } else {
+            start_main_task();
+        }
+        run();
+        out.flush();
+        return !suspended;
+    }
+
+    // records the running task's frames, the innermost at the instruction about
+    // to run and every caller at its call
+    void sample_stack(size_t inst_ip) {
+        const auto& frames = cur_task->frames;
+        size_t first = frames.size() > StackSampler::MAX_DEPTH ? frames.size() - StackSampler::MAX_DEPTH : 0;
+
+        uint32_t flags = 0;
+        if (first > 0) flags |= StackSampler::TRUNCATED;
+        else if (cur_task->id == 0) flags |= StackSampler::TOP_LEVEL;
+
+        sample_key.clear();
+        sample_key.push_back(flags);
+        for (size_t i = first; i + 1 < frames.size(); i++) {
+            sample_key.push_back(static_cast<uint32_t>(frames[i].ip - 1));
+        }
+        sample_key.push_back(static_cast<uint32_t>(inst_ip));
+        sampler->record(sample_key);
+    }
+
+    // the interpreter loop, returns when every task is done or an invoke()d call
+    // returns. profiling runs its own instantiation, the normal loop has none of it.
+    void run() {
+        if (!profile) return sampler ? run_loop<false, true>() : run_loop<false, false>();
+
+        try {
+            if (sampler) run_loop<true, true>();
+            else run_loop<true, false>();
+        } catch (...) {
+            profile->leave(profile_ticks());
+            throw;
+        }
+        profile->leave(profile_ticks());
+    }
+
+    template <bool PROFILE, bool SAMPLE>
+    void run_loop() {
+        for (;;) {
+            // only the top level code can run off the end, it halts there
+            if (cur_frame->ip >= module.code.size()) {
+                if (finish_task(Value())) continue;
+                break;
+            }
 
-        while (cur_frame->more_insts()) {
             debug_stack();
 
-            uint8_t inst = cur_frame->readByte();
+            size_t inst_ip = cur_frame->ip;
+            uint8_t inst = readByte();
             OpCode opc = static_cast<OpCode>(inst);
+            executed++;
+            if constexpr (PROFILE) profile->enter(inst, profile_ticks());
+            if constexpr (SAMPLE) {
+                if (sampler->due()) sample_stack(inst_ip);
+            }
 
             try {
+                // safepoint, every live value is in a frame here. a heap limit
+                // error raised by the collection is reported at this instruction.
+                if (heap.needs_gc()) collect_garbage();
+
                 switch (opc) {
                     case OpCode::PUSHK: {
-                        uint8_t type_byte = cur_frame->readByte();
-                        // "mark" its a string
-                        if (type_byte == 0xFF) {
-                            if (debug) {
-                                print("pushing a string constant");
-                            }
+                        int value = (readByte() << 24) |
+                                    (readByte() << 16) |
+                                    (readByte() << 8) |
+                                    readByte();
+                        cur_task->push(Value(value));
+                        break;
+                    }
+                    case OpCode::PUSHS: {
+                        uint16_t index = (readByte() << 8) | readByte();
+                        if (index >= constants.size()) {
+                            throw Error("Constant index out of range.");
+                        }
 
-                            std::string str;
-                            uint8_t c;
-                            while ((c = cur_frame->readByte()) != 0) {
-                                str += static_cast<char>(c);
-                            }
-                            cur_frame->push(Value(str));
-                            continue;
-                        } else {
-                            // int consts
-                            int value = (type_byte << 24) |
-                                      (cur_frame->readByte() << 16) |
-                                      (cur_frame->readByte() << 8) |
-                                      cur_frame->readByte();
-                            cur_frame->push(Value(value));
-                            continue;
+                        if (debug) {
+                            print("pushing string constant #" + std::to_string(index));
                         }
+
+                        Value& k = constants[index];
+                        if (k.type != Type::STRING) k = Value(heap.intern(module.constants[index]));
+                        cur_task->push(k);
                         break;
                     }
                     case OpCode::LOAD: {
-                        uint8_t index = cur_frame->readByte();
-                        Value value = cur_frame->getLocal(index);
-                        cur_frame->push(value);
+                        uint8_t index = readByte();
+                        Value value = cur_task->local(index);
+                        cur_task->push(value);
                         break;
                     }
                     case OpCode::STORE: {
-                        uint8_t index = cur_frame->readByte();
-                        Value value = cur_frame->peek();
-                        cur_frame->setLocal(index, value);
+                        uint8_t index = readByte();
+                        Value value = cur_task->peek();
+                        cur_task->local(index) = value;
                         break;
                     }
                     case OpCode::PUSH: {
-                        uint8_t val = cur_frame->readByte();
+                        uint8_t val = readByte();
 
                         if (debug) {
                             print("PUSH: raw byte = 0x" + to_hex(val));
@@ -401,12 +1610,12 @@ public:
                             if (debug) {
                                 print("Pushing boolean: " + std::string(bvalue ? "true" : "false"));
                             }
-                            cur_frame->push(Value(bvalue));
+                            cur_task->push(Value(bvalue));
                         } else {
                             if (debug) {
                                 print("Pushing integer: " + std::to_string(val));
                             }
-                            cur_frame->push(Value(static_cast<int>(val)));
+                            cur_task->push(Value(static_cast<int>(val)));
                         }
                         break;
                     }
@@ -432,13 +1641,13 @@ public:
                         unary(opc);
                         break;
                     case OpCode::JMP: {
-                        uint16_t offset = (cur_frame->readByte() << 8) | cur_frame->readByte();
-                        cur_frame->setIP(cur_frame->getIP() + offset - 2);
+                        uint16_t offset = (readByte() << 8) | readByte();
+                        cur_frame->ip += offset - 2;
                         break;
                     }
                     case OpCode::JMPF: {
-                        uint16_t offset = (cur_frame->readByte() << 8) | cur_frame->readByte();
-                        Value condition = cur_frame->pop();
+                        uint16_t offset = (readByte() << 8) | readByte();
+                        Value condition = cur_task->pop();
 
                         bool jump = false;
                         if (condition.type == Type::BOOL) {
@@ -450,177 +1659,260 @@ public:
                         }
 
                         if (jump) {
-                            cur_frame->setIP(cur_frame->getIP() + offset - 2);
+                            cur_frame->ip += offset - 2;
                         }
 
                         break;
                     }
-                    case OpCode::MKARR: {
-                        uint8_t type_byte = cur_frame->readByte();
-                        Type e_type = static_cast<Type>(type_byte);
-                        ArrayValue arr(e_type);
-                        cur_frame->push(Value(arr));
-                        break;
-                    }
+                    case OpCode::MKARR:
                     case OpCode::MKVEC: {
-                        uint8_t type_byte = cur_frame->readByte();
+                        uint8_t type_byte = readByte();
                         Type e_type = static_cast<Type>(type_byte);
-                        VectorValue vec(e_type);
-                        cur_frame->push(Value(vec));
+                        Type type = opc == OpCode::MKARR ? Type::ARRAY : Type::VECTOR;
+                        cur_task->push(Value(type, heap.make_array(e_type)));
                         break;
                     }
                     case OpCode::APUSH: {
-                        Value elem = cur_frame->pop();
-                        Value arr = cur_frame->pop();
+                        Value elem = cur_task->pop();
+                        Value arr = cur_task->pop();
 
-                        if (arr.type == Type::ARRAY) {
-                            arr.avalue->elements.push_back(elem);
-                        } else if (arr.type == Type::VECTOR) {
-                            arr.vvalue->elements.push_back(elem);
-                        } else {
+                        if (arr.type != Type::ARRAY && arr.type != Type::VECTOR) {
                             throw Error("Cannot push to non-array type.");
                         }
 
-                        cur_frame->push(arr);
+                        if (elem.type != arr.avalue->element_type) {
+                            throw Error("Type mismatch in array literal");
+                        }
+
+                        heap.push(arr.avalue, elem);
+                        cur_task->push(arr);
                         break;
                     }
                     case OpCode::GETIDX: {
-                        Value idx = cur_frame->pop();
-                        Value arr = cur_frame->pop();
-
-                        if (idx.type != Type::INT) {
-                            throw Error("Array index must be a numeric literal.");
-                        }
-
-                        if (arr.type == Type::ARRAY) {
-                            Value elem = arr.avalue->get(idx.ivalue);
-                            cur_frame->push(elem);
-                        } else if (arr.type == Type::VECTOR) {
-                            Value elem = arr.vvalue->get(idx.ivalue);
-                            cur_frame->push(elem);
-                        } else {
-                            print(std::to_string(static_cast<int>(arr.type)));
-                            throw Error("Cannot index non-array type.");
-                        }
-
+                        Value idx = cur_task->pop();
+                        Value arr = cur_task->pop();
+                        cur_task->push(load_element(arr, idx));
+                        break;
+                    }
+                    case OpCode::GETIDX_LOCAL: {
+                        uint8_t slot = readByte();
+                        Value idx = cur_task->pop();
+                        cur_task->push(load_element(cur_task->local(slot), idx));
                         break;
                     }
                     case OpCode::SETIDX: {
-                        Value value = cur_frame->pop();
-                        Value idx = cur_frame->pop();
-                        Value arr = cur_frame->pop();
-                        
-                        if (idx.type != Type::INT) {
-                            throw Error("Array index must be a numeric literal.");
-                        }
-                        
-                        if (arr.type == Type::ARRAY) {
-                            arr.avalue->set(idx.ivalue, value);
-                        } else if (arr.type == Type::VECTOR) {
-                            arr.vvalue->set(idx.ivalue, value);
-                        } else {
-                            throw Error("Cannot index non-array type.");
-                        }
-                        
-                        cur_frame->push(arr);
+                        Value value = cur_task->pop();
+                        Value idx = cur_task->pop();
+                        Value arr = cur_task->pop();
+                        store_element(arr, idx, value);
+                        cur_task->push(arr);
+                        break;
+                    }
+                    case OpCode::SETIDX_LOCAL: {
+                        // the element is written straight into the array the local refers to
+                        uint8_t slot = readByte();
+                        Value value = cur_task->pop();
+                        Value idx = cur_task->pop();
+                        Value arr = cur_task->local(slot);
+                        store_element(arr, idx, value);
+                        cur_task->push(arr);
                         break;
                     }
                     case OpCode::ASIZE: {
-                        Value v = cur_frame->pop();
+                        Value v = cur_task->pop();
         
                         if (v.type == Type::ARRAY) {
-                            cur_frame->push(Value(static_cast<int>(v.avalue->size())));
+                            cur_task->push(Value(static_cast<int>(v.avalue->size())));
                         } else if (v.type == Type::VECTOR) {
-                            cur_frame->push(Value(static_cast<int>(v.vvalue->size())));
+                            cur_task->push(Value(static_cast<int>(v.vvalue->size())));
                         } else if (v.type == Type::STRING) {
-                            cur_frame->push(Value(static_cast<int>(v.svalue->size())));
+                            cur_task->push(Value(static_cast<int>(v.svalue->length)));
                         } else {
                             throw Error("Cannot get size of non-array type.");
                         }
                         break;
                     }
+                    case OpCode::ASUM:
+                    case OpCode::AMIN:
+                    case OpCode::AMAX:
+                    case OpCode::AFIND:
+                    case OpCode::ACOUNT:
+                    case OpCode::AFILL:
+                    case OpCode::AADD:
+                    case OpCode::AMUL:
+                        array_builtin(opc);
+                        break;
                     case OpCode::VBACK: {
                         print("Warning: back() function is deprecated and should not be used.");
-                        // Value value = cur_frame->pop();
-                        // Value vec = cur_frame->peek();
+                        // Value value = cur_task->pop();
+                        // Value vec = cur_task->peek();
                         
                         // if (vec.type != Type::VECTOR) {
                         //     throw Error("back() can only be used with vectors.");
                         // }
                         
                         // vec.vvalue->push_back(value);
-                        // cur_frame->push(vec);
+                        // cur_task->push(vec);
                         break;
                     }
                     case OpCode::ENTER: {
-                        uint8_t locals_count = cur_frame->readByte();
-                        for (uint8_t i = 0; i < locals_count; i++) {
-                            cur_frame->setLocal(i, Value(0));
-                        }
+                        // the arguments are already the low slots, the rest start zeroed
+                        cur_task->reserve_locals(readByte());
                         break;
                     }
                     case OpCode::CALL: {
+                        if (out_of_fuel()) suspend(inst_ip);
+
                         // read bytecode offset in 32 bit
-                        size_t offset = (cur_frame->readByte() << 24) |
-                                      (cur_frame->readByte() << 16) |
-                                      (cur_frame->readByte() << 8) |
-                                      cur_frame->readByte();
-                        
-                        call_function(offset);
+                        size_t offset = (readByte() << 24) |
+                                      (readByte() << 16) |
+                                      (readByte() << 8) |
+                                      readByte();
+                        uint8_t arg_count = readByte();
+
+                        call_function(offset, arg_count);
                         break;
                     }
                     case OpCode::RET: {
-                        Value return_value = cur_frame->pop();
-                        call_stack.pop_back();
-                        
-                        if (!call_stack.empty()) {
-                            call_stack.back()->push(return_value);
+                        if (cur_task->frames.size() > 1) {
+                            Value return_value = cur_task->ret();
+                            cur_frame = &cur_task->frames.back();
+                            cur_task->push(return_value);
+                            if (cur_task->frames.size() == stop_depth) return;
+                            break;
+                        }
+
+                        // the bottom frame of a spawned task returning ends the task
+                        if (cur_task->id == 0) {
+                            throw Error("Cannot return from global scope.");
+                        }
+                        if (!finish_task(cur_task->pop())) {
+                            out.flush();
+                            return;
                         }
                         break;
                     }
                     case OpCode::PRINT: {
-                        Value value = cur_frame->peek();
-                        print_value(value);
-                        cur_frame->pop();
+                        uint8_t arg_count = readByte();
+                        print_values(arg_count);
+                        break;
+                    }
+                    case OpCode::SPAWN: {
+                        if (out_of_fuel()) suspend(inst_ip);
+
+                        size_t offset = (readByte() << 24) |
+                                        (readByte() << 16) |
+                                        (readByte() << 8) |
+                                        readByte();
+                        uint8_t arg_count = readByte();
+
+                        spawn(offset, arg_count);
+                        break;
+                    }
+                    case OpCode::YIELD:
+                        yield();
+                        break;
+                    case OpCode::JOIN:
+                        join(inst_ip);
+                        break;
+                    case OpCode::PMAP:
+                    case OpCode::PFOR:
+                        parallel_map(opc, inst_ip);
+                        break;
+                    case OpCode::CHOPEN:
+                        open_channel();
+                        break;
+                    case OpCode::CHSEND:
+                        channel_send(inst_ip);
+                        break;
+                    case OpCode::CHRECV:
+                        channel_recv(inst_ip);
+                        break;
+                    case OpCode::CHTRY:
+                        channel_try_recv();
+                        break;
+                    case OpCode::CHECKPOINT:
+                        if (checkpoint()) {
+                            out.flush();
+                            return;
+                        }
+                        break;
+                    case OpCode::CALLNATIVE: {
+                        uint16_t index = (readByte() << 8) | readByte();
+                        uint8_t arg_count = readByte();
+
+                        call_native(index, arg_count);
                         break;
                     }
+                    case OpCode::READF:
+                        start_io(IoOp::Kind::READ);
+                        break;
+                    case OpCode::WRITEF:
+                        start_io(IoOp::Kind::WRITE);
+                        break;
                     case OpCode::HALT:
+                        out.flush();
                         if (debug) {
                             print("cvm halted.");
                         }
+
+                        // tasks still running are finished before the vm returns
+                        if (finish_task(Value())) break;
                         return;
                     default:
                         throw Error("Unknown opcode: " + std::to_string(inst));
                 }
-            } catch (const Error& e) {
-                print("Runtime error at ip=" + std::to_string(cur_frame->getIP()) + 
-                      ": " + std::string(e.what()));
+            } catch (const Suspended&) {
+                suspended = true;
+                out.flush();
+                return;
+            } catch (const std::exception& e) {
+                out.flush();
+                std::string where = cur_task->id == 0 ? "" : " in task " + std::to_string(cur_task->id);
+                report("Runtime error" + where + " at " + module.describe(inst_ip) + ": " + std::string(e.what()));
+
+                // the return address of each caller sits just past its CALL
+                // the innermost callers only, a runaway recursion has millions of them
+                const auto& frames = cur_task->frames;
+                size_t shown = 0;
+                for (size_t i = frames.size() - 1; i-- > 0; shown++) {
+                    if (shown == MAX_TRACE) {
+                        report("  ... " + std::to_string(i + 1) + " more");
+                        break;
+                    }
+                    report("  called from " + module.describe(frames[i].ip - 1));
+                }
                 throw;
             }
         }
     }
 
+    // top of the top level code's operand stack
     Value getResult() {
-        if (!cur_frame) {
+        if (tasks.empty()) {
             throw Error("No frame available");
         }
-        return cur_frame->getResult();
-    }
 
-    std::string getResultAsString() {
-        if (!cur_frame) {
-            throw Error("No frame available");
+        Task& main_task = *tasks[0];
+        if (main_task.stack.size() <= MAX_GLOBALS) {
+            throw Error("No result on stack.");
         }
+        return main_task.stack.back();
+    }
 
-        Value result = cur_frame->getResult();
+    std::string getResultAsString() {
+        Value result = getResult();
         switch (result.type) {
             case Type::INT:
                 return std::to_string(result.ivalue);
             case Type::BOOL:
                 return result.bvalue ? "true" : "false";
-            case Type::STRING:
+            case Type::STRING: {
                 print("Found string");
-                return *result.svalue;
+                std::string text;
+                each_piece(result.svalue, [&](std::string_view piece) { text += piece; });
+                return text;
+            }
             default: return "UNKNOWN";
         }
     }
@@ -0,0 +1,636 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#include "ctypes.hpp"
+#include "pool.hpp"
+
+struct HeapConfig {
+    size_t nursery_size    = 1 << 20;  // bytes, young objects are bump allocated here
+    size_t major_threshold = 8 << 20;  // minimum old generation size before a major collection
+    size_t intern_limit    = 0;        // runtime strings up to this length are interned, 0 = literals only
+    size_t memory_limit    = 0;        // bytes in use before HeapLimitError is raised, 0 = unlimited
+    bool   use_pool        = true;     // small old objects come from size class pools instead of malloc
+};
+
+// raised when a script needs more heap than HeapConfig::memory_limit allows. the
+// heap stays consistent, so the host can report it and reuse or drop the vm.
+class HeapLimitError : public std::runtime_error {
+public:
+    explicit HeapLimitError(const std::string& msg) : std::runtime_error(msg) {}
+};
+
+struct GCStats {
+    size_t   minor_collections = 0;
+    size_t   major_collections = 0;
+    size_t   bytes_allocated = 0;   // everything ever allocated
+    size_t   bytes_promoted = 0;    // young bytes that survived into the old generation
+    size_t   bytes_freed = 0;       // old bytes reclaimed by major collections
+    size_t   old_bytes = 0;         // current size of the old generation
+    uint64_t minor_ns = 0;
+    uint64_t major_ns = 0;
+    uint64_t max_pause_ns = 0;
+    size_t   interned_strings = 0;
+    size_t   peak_bytes = 0;        // high water mark of old plus nursery bytes in use
+
+    size_t allocated_by_kind[OBJ_KIND_COUNT] = {};  // everything ever allocated, per ObjKind
+    size_t old_by_kind[OBJ_KIND_COUNT] = {};        // current old generation, per ObjKind
+};
+
+// fnv1a, never 0 so 0 can mean "not computed yet"
+inline uint32_t hash_string(std::string_view text) {
+    uint32_t h = 2166136261u;
+    for (char c : text) {
+        h ^= static_cast<uint8_t>(c);
+        h *= 16777619u;
+    }
+    return h ? h : 1;
+}
+
+// frozen strings are flat, immutable and reference counted. they live outside
+// every heap, so any number of vms can hold the same one: channels pass them
+// between vms without copying. the count sits in the 8 bytes in front of the
+// object and the hash is filled in up front, nothing writes to one once built.
+static const size_t FROZEN_PREFIX = 8;
+
+inline std::atomic<uint32_t>& frozen_refs(StringObject* s) {
+    return *reinterpret_cast<std::atomic<uint32_t>*>(reinterpret_cast<char*>(s) - FROZEN_PREFIX);
+}
+
+// a frozen copy of text with one reference
+inline StringObject* freeze_string(std::string_view text) {
+    if (text.size() > UINT32_MAX) throw std::runtime_error("String too long.");
+
+    size_t size = sizeof(StringObject) + text.size();
+    char* block = static_cast<char*>(std::malloc(FROZEN_PREFIX + size));
+    if (!block) throw std::bad_alloc();
+    new (block) std::atomic<uint32_t>(1);
+
+    StringObject* s = reinterpret_cast<StringObject*>(block + FROZEN_PREFIX);
+    s->size = static_cast<uint32_t>(size);
+    s->kind = ObjKind::STRING;
+    s->flags = OBJ_OLD | OBJ_FROZEN;
+    s->aux = 0;
+    s->link = nullptr;
+    s->length = static_cast<uint32_t>(text.size());
+    s->hash = hash_string(text);
+    std::memcpy(s->chars(), text.data(), text.size());
+    return s;
+}
+
+inline void retain_frozen(StringObject* s) {
+    frozen_refs(s).fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void release_frozen(StringObject* s) {
+    if (frozen_refs(s).fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        std::free(reinterpret_cast<char*>(s) - FROZEN_PREFIX);
+    }
+}
+
+// weak set of interned strings with linear probing. interned strings are always
+// allocated old so they never move, dead ones are dropped after a major collection.
+class StringTable {
+private:
+    std::vector<StringObject*> slots;
+    size_t                     count = 0;
+
+    void place(StringObject* s) {
+        size_t mask = slots.size() - 1;
+        size_t i = s->hash & mask;
+        while (slots[i]) i = (i + 1) & mask;
+        slots[i] = s;
+    }
+
+    void rebuild(size_t capacity) {
+        std::vector<StringObject*> old = std::move(slots);
+        slots.assign(capacity, nullptr);
+        for (StringObject* s : old) {
+            if (s) place(s);
+        }
+    }
+
+public:
+    StringObject* find(std::string_view text, uint32_t hash) const {
+        if (slots.empty()) return nullptr;
+
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash & mask; slots[i]; i = (i + 1) & mask) {
+            StringObject* s = slots[i];
+            if (s->hash == hash && s->view() == text) return s;
+        }
+        return nullptr;
+    }
+
+    void insert(StringObject* s) {
+        if ((count + 1) * 2 > slots.size()) rebuild(slots.empty() ? 64 : slots.size() * 2);
+        place(s);
+        count++;
+    }
+
+    // drops every string is_live() rejects
+    template <typename F>
+    void purge(F&& is_live) {
+        for (StringObject*& s : slots) {
+            if (s && !is_live(s)) {
+                s = nullptr;
+                count--;
+            }
+        }
+        rebuild(slots.size());
+    }
+
+    size_t size() const { return count; }
+};
+
+// generational heap. new objects are bump allocated in the nursery, survivors of
+// a minor collection are copied (promoted) straight into the old generation, which
+// is a non moving mark/sweep space. old objects that get a young reference stored
+// into them are kept in a remembered set by the write barrier.
+//
+// allocation never collects by itself, it only requests a collection. the vm runs
+// collect() at instruction boundaries, where every live value is reachable from
+// the roots it reports, so native code never sees an object move under it.
+class Heap {
+private:
+    HeapConfig config;
+
+    char* nursery = nullptr;
+    char* top = nullptr;
+    char* limit = nullptr;
+    size_t large_limit;
+
+    Obj*              old_objects = nullptr;
+    size_t            next_major;
+    std::vector<Obj*> remembered;
+    std::vector<Obj*> gray;
+    bool              pending = false;
+    bool              over_limit = false;  // memory_limit was crossed, checked at the next collection
+    StringTable       interned;
+    Pool              pool;
+
+    // frozen strings this heap holds a reference to. they are not in old_objects
+    // and their headers are shared, so a major collection notes the ones it
+    // reaches in frozen_seen and drops the references to the rest.
+    std::unordered_set<StringObject*> frozen;
+    std::vector<StringObject*>        frozen_seen;
+
+    GCStats stats;
+
+    // one nursery per thread is kept when a heap dies, so a worker running vm
+    // after vm reuses memory that is already mapped and warm
+    struct SpareNursery {
+        char*  block = nullptr;
+        size_t size = 0;
+
+        ~SpareNursery() { std::free(block); }
+    };
+
+    static SpareNursery& spare_nursery() {
+        thread_local SpareNursery spare;
+        return spare;
+    }
+
+    static size_t align(size_t size) {
+        return (size + 7) & ~static_cast<size_t>(7);
+    }
+
+    bool is_young(const Obj* o) const {
+        return !(o->flags & OBJ_OLD);
+    }
+
+    // backing memory for old objects
+    void* raw_alloc(size_t size) {
+        if (config.use_pool) return pool.alloc(size);
+
+        void* p = std::malloc(size);
+        if (!p) throw std::bad_alloc();
+        return p;
+    }
+
+    void raw_free(Obj* o) {
+        if (config.use_pool) pool.free(o, o->size);
+        else std::free(o);
+    }
+
+    size_t in_use() const {
+        return stats.old_bytes + static_cast<size_t>(top - nursery);
+    }
+
+    // accounting shared by every allocation. garbage counts toward the limit until
+    // it is collected, so crossing it only requests a full collection; the limit is
+    // enforced at the next safepoint. a request that could never fit, or that would
+    // overshoot by more than the limit itself, fails right away.
+    void account(size_t size, ObjKind kind) {
+        size_t used = in_use() + size;
+
+        if (config.memory_limit && used > config.memory_limit) {
+            if (size > config.memory_limit || used - config.memory_limit > config.memory_limit) {
+                throw HeapLimitError("Heap limit of " + std::to_string(config.memory_limit) +
+                                     " bytes exceeded (" + std::to_string(used) + " bytes requested)");
+            }
+            over_limit = true;
+            pending = true;
+        }
+
+        stats.bytes_allocated += size;
+        stats.allocated_by_kind[static_cast<size_t>(kind)] += size;
+        if (used > stats.peak_bytes) stats.peak_bytes = used;
+    }
+
+    Obj* allocate_old(size_t size, ObjKind kind) {
+        Obj* o = static_cast<Obj*>(raw_alloc(size));
+
+        o->size = static_cast<uint32_t>(size);
+        o->kind = kind;
+        o->flags = OBJ_OLD;
+        o->link = old_objects;
+        old_objects = o;
+
+        stats.old_bytes += size;
+        stats.old_by_kind[static_cast<size_t>(kind)] += size;
+        if (stats.old_bytes >= next_major) pending = true;
+        return o;
+    }
+
+    Obj* allocate(size_t size, ObjKind kind) {
+        size = align(size);
+        account(size, kind);
+        Obj* o;
+
+        if (size <= large_limit && top + size <= limit) {
+            o = reinterpret_cast<Obj*>(top);
+            top += size;
+            o->size = static_cast<uint32_t>(size);
+            o->flags = 0;
+            o->link = nullptr;
+        } else {
+            // large objects and overflow while a collection is pending go straight
+            // to the old generation. they may receive young references before the
+            // next collection, so they start out remembered.
+            o = allocate_old(size, kind);
+            if (size <= large_limit) pending = true;
+            o->flags |= OBJ_REMEMBERED;
+            remembered.push_back(o);
+        }
+
+        o->kind = kind;
+        o->aux = 0;
+        return o;
+    }
+
+    // calls f(Obj*) -> Obj* for every reference held by o and stores the result back
+    template <typename F>
+    void trace(Obj* o, F&& f) {
+        switch (o->kind) {
+            case ObjKind::STRING:
+                break;
+            case ObjKind::ROPE: {
+                RopeObject* r = static_cast<RopeObject*>(o);
+                r->left = static_cast<StringObject*>(f(r->left));
+                if (r->right) r->right = static_cast<StringObject*>(f(r->right));
+                break;
+            }
+            case ObjKind::ARRAY: {
+                ArrayObject* a = static_cast<ArrayObject*>(o);
+                a->buffer = static_cast<BufferObject*>(f(a->buffer));
+                break;
+            }
+            case ObjKind::BUFFER: {
+                // only string buffers hold references, int and bool elements are raw
+                BufferObject* b = static_cast<BufferObject*>(o);
+                if (b->element_type != Type::STRING) break;
+
+                StringObject** data = b->strings();
+                for (uint32_t i = 0; i < b->capacity; i++) {
+                    if (data[i]) data[i] = static_cast<StringObject*>(f(data[i]));
+                }
+                break;
+            }
+        }
+    }
+
+    Obj* forward(Obj* o) {
+        if (!is_young(o)) return o;
+        if (o->flags & OBJ_FORWARDED) return o->link;
+
+        Obj* copy = static_cast<Obj*>(raw_alloc(o->size));
+        std::memcpy(copy, o, o->size);
+        copy->flags = OBJ_OLD;
+        copy->link = old_objects;
+        old_objects = copy;
+
+        stats.old_bytes += o->size;
+        stats.old_by_kind[static_cast<size_t>(o->kind)] += o->size;
+        stats.bytes_promoted += o->size;
+
+        o->flags |= OBJ_FORWARDED;
+        o->link = copy;
+        gray.push_back(copy);
+        return copy;
+    }
+
+    Obj* mark(Obj* o) {
+        if (o->flags & OBJ_FROZEN) {
+            frozen_seen.push_back(static_cast<StringObject*>(o));
+            return o;
+        }
+
+        if (!(o->flags & OBJ_MARKED)) {
+            o->flags |= OBJ_MARKED;
+            gray.push_back(o);
+        }
+        return o;
+    }
+
+    template <typename Roots>
+    void minor(Roots&& roots) {
+        auto fwd = [this](Obj* o) { return forward(o); };
+
+        roots([&](Value& v) {
+            if (v.is_heap()) v.set_obj(forward(v.obj()));
+        });
+
+        for (Obj* o : remembered) {
+            o->flags &= ~OBJ_REMEMBERED;
+            trace(o, fwd);
+        }
+        remembered.clear();
+
+        while (!gray.empty()) {
+            Obj* o = gray.back();
+            gray.pop_back();
+            trace(o, fwd);
+        }
+
+        top = nursery;
+        stats.minor_collections++;
+    }
+
+    // only runs right after a minor collection, so every live object is old
+    template <typename Roots>
+    void major(Roots&& roots) {
+        auto mk = [this](Obj* o) { return mark(o); };
+
+        roots([&](Value& v) {
+            if (v.is_heap()) mark(v.obj());
+        });
+
+        while (!gray.empty()) {
+            Obj* o = gray.back();
+            gray.pop_back();
+            trace(o, mk);
+        }
+
+        interned.purge([](StringObject* s) { return (s->flags & OBJ_MARKED) != 0; });
+        stats.interned_strings = interned.size();
+
+        if (!frozen.empty()) {
+            std::unordered_set<StringObject*> live(frozen_seen.begin(), frozen_seen.end());
+            for (auto it = frozen.begin(); it != frozen.end();) {
+                if (live.count(*it)) {
+                    ++it;
+                } else {
+                    release_frozen(*it);
+                    it = frozen.erase(it);
+                }
+            }
+        }
+        frozen_seen.clear();
+
+        Obj** link = &old_objects;
+        while (*link) {
+            Obj* o = *link;
+            if (o->flags & OBJ_MARKED) {
+                o->flags &= ~OBJ_MARKED;
+                link = &o->link;
+            } else {
+                *link = o->link;
+                stats.old_bytes -= o->size;
+                stats.old_by_kind[static_cast<size_t>(o->kind)] -= o->size;
+                stats.bytes_freed += o->size;
+                raw_free(o);
+            }
+        }
+
+        next_major = std::max(config.major_threshold, stats.old_bytes * 2);
+        stats.major_collections++;
+    }
+
+public:
+    explicit Heap(const HeapConfig& cfg = HeapConfig())
+        : config(cfg), large_limit(cfg.nursery_size / 4), next_major(cfg.major_threshold) {
+        SpareNursery& spare = spare_nursery();
+        if (spare.block && spare.size == config.nursery_size) {
+            nursery = spare.block;
+            spare.block = nullptr;
+        } else {
+            nursery = static_cast<char*>(std::malloc(config.nursery_size));
+            if (!nursery) throw std::bad_alloc();
+        }
+        top = nursery;
+        limit = nursery + config.nursery_size;
+    }
+
+    ~Heap() {
+        for (StringObject* s : frozen) release_frozen(s);
+        while (old_objects) {
+            Obj* next = old_objects->link;
+            raw_free(old_objects);
+            old_objects = next;
+        }
+        SpareNursery& spare = spare_nursery();
+        if (!spare.block) {
+            spare.block = nursery;
+            spare.size = config.nursery_size;
+        } else {
+            std::free(nursery);
+        }
+    }
+
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+
+    // uninitialised characters, the caller fills them in
+    StringObject* make_string(size_t length) {
+        StringObject* s = static_cast<StringObject*>(allocate(sizeof(StringObject) + length, ObjKind::STRING));
+        s->length = static_cast<uint32_t>(length);
+        s->hash = 0;
+        return s;
+    }
+
+    StringObject* make_string(std::string_view text) {
+        StringObject* s = make_string(text.size());
+        std::memcpy(s->chars(), text.data(), text.size());
+        return s;
+    }
+
+    RopeObject* make_rope(StringObject* left, StringObject* right) {
+        RopeObject* r = static_cast<RopeObject*>(allocate(sizeof(RopeObject), ObjKind::ROPE));
+        r->length = left->length + right->length;
+        r->hash = 0;
+        r->left = left;
+        r->right = right;
+        return r;
+    }
+
+    // the unique string with this content. interned strings go straight to the old
+    // generation and carry their hash, so equality against them is a pointer or
+    // hash compare.
+    StringObject* intern(std::string_view text) {
+        uint32_t hash = hash_string(text);
+        if (StringObject* s = interned.find(text, hash)) return s;
+
+        size_t size = align(sizeof(StringObject) + text.size());
+        account(size, ObjKind::STRING);
+        StringObject* s = static_cast<StringObject*>(allocate_old(size, ObjKind::STRING));
+        s->aux = 0;
+        s->flags |= OBJ_INTERNED;
+        s->length = static_cast<uint32_t>(text.size());
+        s->hash = hash;
+        std::memcpy(s->chars(), text.data(), text.size());
+
+        interned.insert(s);
+        stats.interned_strings = interned.size();
+        return s;
+    }
+
+    // takes over one reference to a frozen string, so it stays alive while this
+    // heap can reach it
+    StringObject* adopt_frozen(StringObject* s) {
+        if (!frozen.insert(s).second) release_frozen(s);
+        return s;
+    }
+
+    size_t intern_limit() const { return config.intern_limit; }
+    const HeapConfig& configuration() const { return config; }
+
+    BufferObject* make_buffer(Type element_type, uint32_t capacity) {
+        size_t bytes = capacity * element_size(element_type);
+        BufferObject* b = static_cast<BufferObject*>(allocate(sizeof(BufferObject) + bytes, ObjKind::BUFFER));
+        b->capacity = capacity;
+        b->element_type = element_type;
+        std::memset(b->as<uint8_t>(), 0, bytes);
+        return b;
+    }
+
+    ArrayObject* make_array(Type element_type, uint32_t capacity = 4) {
+        BufferObject* buffer = make_buffer(element_type, capacity);
+        ArrayObject* a = static_cast<ArrayObject*>(allocate(sizeof(ArrayObject), ObjKind::ARRAY));
+        a->element_type = element_type;
+        a->length = 0;
+        a->buffer = buffer;
+        write_barrier(a, buffer);
+        return a;
+    }
+
+    void write_barrier(Obj* holder, Obj* target) {
+        if ((holder->flags & (OBJ_OLD | OBJ_REMEMBERED)) == OBJ_OLD && is_young(target)) {
+            holder->flags |= OBJ_REMEMBERED;
+            remembered.push_back(holder);
+        }
+    }
+
+    void write_barrier(Obj* holder, const Value& v) {
+        if (v.is_heap()) write_barrier(holder, v.obj());
+    }
+
+    void reserve(ArrayObject* a, size_t capacity) {
+        if (capacity <= a->buffer->capacity) return;
+
+        size_t elem = element_size(a->element_type);
+        size_t max_capacity = (UINT32_MAX - sizeof(BufferObject)) / elem;
+        if (capacity > max_capacity) {
+            throw std::runtime_error("[cvm] Array too large");
+        }
+
+        size_t grown = std::max<size_t>(capacity, static_cast<size_t>(a->buffer->capacity) * 2);
+        BufferObject* buffer = make_buffer(a->element_type, static_cast<uint32_t>(std::min(grown, max_capacity)));
+        std::memcpy(buffer->as<uint8_t>(), a->buffer->as<uint8_t>(), a->length * elem);
+        a->buffer = buffer;
+        write_barrier(a, buffer);
+    }
+
+    // v must already have the array's element type
+    void set(ArrayObject* a, size_t index, const Value& v) {
+        BufferObject* b = a->buffer;
+        switch (a->element_type) {
+            case Type::INT:
+                b->ints()[index] = v.ivalue;
+                break;
+            case Type::BOOL:
+                b->bools()[index] = v.bvalue ? 1 : 0;
+                break;
+            case Type::STRING:
+                b->strings()[index] = v.svalue;
+                write_barrier(b, v.svalue);
+                break;
+            default:
+                throw std::runtime_error("[cvm] Invalid array element type");
+        }
+    }
+
+    void push(ArrayObject* a, const Value& v) {
+        reserve(a, a->length + 1);
+        set(a, a->length, v);
+        a->length++;
+    }
+
+    // new int and bool slots read as 0 and false, new string slots as ""
+    void resize(ArrayObject* a, size_t length) {
+        reserve(a, length);
+        if (a->element_type == Type::STRING && length > a->length) {
+            StringObject* empty = intern("");
+            StringObject** data = a->buffer->strings();
+            for (size_t i = a->length; i < length; i++) data[i] = empty;
+        }
+        a->length = static_cast<uint32_t>(length);
+    }
+
+    bool needs_gc() const { return pending; }
+
+    // roots(visit) must call visit(Value&) for every live value outside the heap
+    template <typename Roots>
+    void collect(Roots&& roots) {
+        auto start = std::chrono::steady_clock::now();
+
+        minor(roots);
+        auto after_minor = std::chrono::steady_clock::now();
+        stats.minor_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(after_minor - start).count();
+
+        if (stats.old_bytes >= next_major || over_limit) {
+            major(roots);
+            stats.major_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - after_minor).count();
+        }
+
+        uint64_t pause = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        stats.max_pause_ns = std::max(stats.max_pause_ns, pause);
+        pending = false;
+
+        if (over_limit) {
+            over_limit = false;
+            if (config.memory_limit && in_use() > config.memory_limit) {
+                throw HeapLimitError("Heap limit of " + std::to_string(config.memory_limit) +
+                                     " bytes exceeded (" + std::to_string(in_use()) + " bytes live)");
+            }
+        }
+    }
+
+    size_t young_bytes() const { return top - nursery; }
+    const GCStats& statistics() const { return stats; }
+    const PoolStats& pool_statistics() const { return pool.statistics(); }
+};
@@ -0,0 +1,404 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define CVM_IO_URING
+#endif
+
+// one whole file read or write started by read_file()/write_file()
+struct IoOp {
+    enum class Kind : uint8_t { READ, WRITE };
+
+    Kind        kind;
+    uint32_t    task;      // the handle the script waits on
+    std::string path;
+    std::string data;      // what to write, or what was read
+    int         fd = -1;
+    size_t      done = 0;  // bytes transferred so far
+    int         error = 0; // errno, 0 when it worked
+    iovec       iov;       // the chunk in flight
+    size_t      slot = 0;  // index in IoLoop::ops
+
+    IoOp(Kind kind, uint32_t task, std::string path) : kind(kind), task(task), path(std::move(path)) {}
+};
+
+// runs IoOps off the vm thread. submit() hands one over, reap() collects the
+// finished ones, blocking for at least one when wait is set. an op is owned by
+// the caller and must stay alive until it has been reaped.
+class IoBackend {
+public:
+    virtual ~IoBackend() = default;
+    virtual const char* name() const = 0;
+    virtual void submit(IoOp* op) = 0;
+    virtual void reap(std::vector<IoOp*>& done, bool wait) = 0;
+};
+
+namespace io_detail {
+
+static const size_t READ_CHUNK = 64 * 1024;
+
+inline bool open_op(IoOp* op) {
+    op->fd = op->kind == IoOp::Kind::READ
+        ? ::open(op->path.c_str(), O_RDONLY | O_CLOEXEC)
+        : ::open(op->path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (op->fd < 0) {
+        op->error = errno;
+        return false;
+    }
+
+    // reads are sized from the file, files that report no size (proc and the
+    // like) grow by a chunk at a time
+    if (op->kind == IoOp::Kind::READ) {
+        struct stat st;
+        size_t size = ::fstat(op->fd, &st) == 0 && st.st_size > 0 ? static_cast<size_t>(st.st_size) : 0;
+        op->data.resize(size > 0 ? size + 1 : READ_CHUNK);
+    }
+    return true;
+}
+
+// the next chunk to transfer, false once the op is complete
+inline bool next_chunk(IoOp* op) {
+    if (op->kind == IoOp::Kind::WRITE) {
+        if (op->done == op->data.size()) return false;
+    } else if (op->done == op->data.size()) {
+        op->data.resize(op->data.size() * 2);
+    }
+
+    op->iov.iov_base = &op->data[op->done];
+    op->iov.iov_len = op->data.size() - op->done;
+    return true;
+}
+
+// applies the result of one transfer, false once the op is complete
+inline bool advance(IoOp* op, ssize_t res) {
+    if (res < 0) {
+        op->error = static_cast<int>(-res);
+        return false;
+    }
+
+    // a read of 0 is the end of the file
+    if (res == 0 && op->kind == IoOp::Kind::READ) return false;
+    op->done += static_cast<size_t>(res);
+    return next_chunk(op);
+}
+
+inline void close_op(IoOp* op) {
+    if (op->fd >= 0) ::close(op->fd);
+    op->fd = -1;
+    if (op->kind == IoOp::Kind::READ) {
+        op->data.resize(op->done);
+        op->data.shrink_to_fit();
+    }
+}
+
+}  // namespace io_detail
+
+// blocking reads and writes on a few worker threads, for kernels without io_uring
+class ThreadPoolBackend : public IoBackend {
+private:
+    static const size_t WORKERS = 4;
+
+    std::mutex               lock;
+    std::condition_variable  work_ready;
+    std::condition_variable  done_ready;
+    std::deque<IoOp*>        queue;
+    std::vector<IoOp*>       finished;
+    std::vector<std::thread> workers;
+    bool                     stopping = false;
+
+    static void run(IoOp* op) {
+        using namespace io_detail;
+        if (!open_op(op)) return;
+        if (!next_chunk(op)) {
+            close_op(op);
+            return;
+        }
+
+        for (;;) {
+            ssize_t res = op->kind == IoOp::Kind::READ
+                ? ::pread(op->fd, op->iov.iov_base, op->iov.iov_len, op->done)
+                : ::pwrite(op->fd, op->iov.iov_base, op->iov.iov_len, op->done);
+            if (res < 0 && errno == EINTR) continue;
+            if (!advance(op, res < 0 ? -errno : res)) break;
+        }
+        close_op(op);
+    }
+
+    void worker() {
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            work_ready.wait(guard, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) return;
+
+            IoOp* op = queue.front();
+            queue.pop_front();
+
+            guard.unlock();
+            run(op);
+            guard.lock();
+
+            finished.push_back(op);
+            done_ready.notify_one();
+        }
+    }
+
+public:
+    ~ThreadPoolBackend() override {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for (auto& t : workers) t.join();
+    }
+
+    const char* name() const override { return "threads"; }
+
+    void submit(IoOp* op) override {
+        std::lock_guard<std::mutex> guard(lock);
+        // started on first use, a vm that never does io never pays for them
+        if (workers.size() < WORKERS && workers.size() < queue.size() + 1) {
+            workers.emplace_back(&ThreadPoolBackend::worker, this);
+        }
+        queue.push_back(op);
+        work_ready.notify_one();
+    }
+
+    void reap(std::vector<IoOp*>& done, bool wait) override {
+        std::unique_lock<std::mutex> guard(lock);
+        if (wait) done_ready.wait(guard, [this] { return !finished.empty(); });
+        done.insert(done.end(), finished.begin(), finished.end());
+        finished.clear();
+    }
+};
+
+#ifdef CVM_IO_URING
+
+// io_uring through the raw syscalls, no liburing needed. opening the file
+// happens on the vm thread, the reads and writes go through the ring, so many
+// of them are in flight at once without a thread each.
+class UringBackend : public IoBackend {
+private:
+    static const unsigned ENTRIES = 64;
+
+    int       ring_fd = -1;
+    void*     sq_ptr = MAP_FAILED;
+    void*     cq_ptr = MAP_FAILED;
+    size_t    sq_size = 0;
+    size_t    cq_size = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+
+    unsigned           in_flight = 0;
+    std::deque<IoOp*>  backlog;   // waiting for a free ring slot
+    std::vector<IoOp*> finished;  // failed to open, or nothing to transfer
+
+    static int enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+        return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+    }
+
+    void queue_chunk(IoOp* op) {
+        if (in_flight == ENTRIES) {
+            backlog.push_back(op);
+            return;
+        }
+
+        unsigned tail = *sq_tail;
+        unsigned index = tail & *sq_mask;
+        io_uring_sqe* sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = op->kind == IoOp::Kind::READ ? IORING_OP_READV : IORING_OP_WRITEV;
+        sqe->fd = op->fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&op->iov);
+        sqe->len = 1;
+        sqe->off = op->done;
+        sqe->user_data = reinterpret_cast<uint64_t>(op);
+
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        in_flight++;
+
+        while (enter(ring_fd, 1, 0, 0) < 0 && errno == EINTR) {}
+    }
+
+    void unmap() {
+        if (sqes != MAP_FAILED) munmap(sqes, ENTRIES * sizeof(io_uring_sqe));
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+        if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+        if (ring_fd >= 0) ::close(ring_fd);
+        ring_fd = -1;
+    }
+
+public:
+    UringBackend() {
+        io_uring_params p;
+        std::memset(&p, 0, sizeof(p));
+        ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, ENTRIES, &p));
+        if (ring_fd < 0) throw std::runtime_error("io_uring unavailable");
+
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+#ifdef IORING_FEAT_SINGLE_MMAP
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+#else
+        bool single = false;
+#endif
+        if (single) sq_size = cq_size = std::max(sq_size, cq_size);
+
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        cq_ptr = single ? sq_ptr
+                        : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        sqes = static_cast<io_uring_sqe*>(mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                                               MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+        if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+            unmap();
+            throw std::runtime_error("io_uring unavailable");
+        }
+
+        char* sq = static_cast<char*>(sq_ptr);
+        char* cq = static_cast<char*>(cq_ptr);
+        sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+    }
+
+    ~UringBackend() override {
+        // the kernel still writes into the buffers of ops in flight
+        std::vector<IoOp*> done;
+        while (in_flight > 0 || !backlog.empty()) reap(done, true);
+        unmap();
+    }
+
+    const char* name() const override { return "io_uring"; }
+
+    void submit(IoOp* op) override {
+        if (!io_detail::open_op(op) || !io_detail::next_chunk(op)) {
+            io_detail::close_op(op);
+            finished.push_back(op);
+            return;
+        }
+        queue_chunk(op);
+    }
+
+    void reap(std::vector<IoOp*>& done, bool wait) override {
+        done.insert(done.end(), finished.begin(), finished.end());
+        bool any = !finished.empty();
+        finished.clear();
+
+        for (;;) {
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+            for (; head != tail; head++) {
+                const io_uring_cqe& cqe = cqes[head & *cq_mask];
+                IoOp* op = reinterpret_cast<IoOp*>(cqe.user_data);
+                in_flight--;
+
+                if (io_detail::advance(op, cqe.res)) {
+                    // short transfer, the rest goes back on the ring
+                    backlog.push_back(op);
+                } else {
+                    io_detail::close_op(op);
+                    done.push_back(op);
+                    any = true;
+                }
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+            while (!backlog.empty() && in_flight < ENTRIES) {
+                IoOp* op = backlog.front();
+                backlog.pop_front();
+                queue_chunk(op);
+            }
+
+            if (any || !wait || in_flight == 0) return;
+            while (enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno == EINTR) {}
+        }
+    }
+};
+
+#endif
+
+// io_uring when the kernel has it, worker threads otherwise. CVM_IO=threads
+// forces the fallback.
+inline std::unique_ptr<IoBackend> make_io_backend() {
+#ifdef CVM_IO_URING
+    const char* choice = std::getenv("CVM_IO");
+    if (!choice || std::strcmp(choice, "threads") != 0) {
+        try {
+            return std::make_unique<UringBackend>();
+        } catch (const std::exception&) {}
+    }
+#endif
+    return std::make_unique<ThreadPoolBackend>();
+}
+
+// a vm's outstanding file operations. the backend is only created by the first
+// one, so vms that never touch a file stay as cheap as before.
+class IoLoop {
+private:
+    std::vector<std::unique_ptr<IoOp>> ops;      // submitted and not reaped yet
+    std::unique_ptr<IoBackend>         backend;  // declared after ops, so it is gone before them
+    std::vector<IoOp*>                 done;
+
+public:
+    size_t pending() const { return ops.size(); }
+    const char* backend_name() const { return backend ? backend->name() : "none"; }
+
+    void submit(std::unique_ptr<IoOp> op) {
+        if (!backend) backend = make_io_backend();
+        op->slot = ops.size();
+        ops.push_back(std::move(op));
+        backend->submit(ops.back().get());
+    }
+
+    // calls f with every finished op, then frees it
+    template <typename F>
+    void reap(bool wait, F&& f) {
+        if (ops.empty()) return;
+
+        done.clear();
+        backend->reap(done, wait);
+        for (IoOp* op : done) {
+            f(*op);
+
+            size_t slot = op->slot;
+            ops[slot] = std::move(ops.back());
+            ops[slot]->slot = slot;
+            ops.pop_back();
+        }
+    }
+};
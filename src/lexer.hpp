@@ -1,9 +1,10 @@
 #include "cvm.hpp"
+#include "arena.hpp"
 #include <cctype>
 #include <cstddef>
-#include <unordered_map>
 #include <vector>
 #include <string>
+#include <string_view>
 
 enum class TokenType {
     IDENTIFIER,
@@ -31,26 +32,29 @@ enum class TokenType {
     EOS,
 };
 
+// token text points into the arena the lexer was given
 typedef struct Token {
     TokenType type;
-    std::string value;
+    std::string_view value;
     size_t line, col;
 
-    Token(const TokenType& type, const std::string& value, size_t line, size_t col)
+    Token(const TokenType& type, std::string_view value, size_t line, size_t col)
         : type(type), value(value), line(line), col(col) {}
 } Token;
 
+using TokenList = std::vector<Token, ArenaAllocator<Token>>;
+
 class Lexer {
 private:
-    std::string source;
-    size_t position, l = 0, c;  // l = line, c = column
+    Arena&           arena;
+    std::string_view source;
+    size_t position, l = 1, c = 1;  // l = line, c = column
+    size_t tl = 1, tc = 1;          // where the current token starts
+    size_t start = 0;
     char current;
 
-    std::unordered_map<std::string, TokenType> keywords;
-
-public:
-    Lexer(const std::string& source) : source(source), position(0), current(source.empty() ? '\0' : source[0]) {
-        keywords = {
+    static bool keyword(std::string_view word, TokenType& type) {
+        static const struct { std::string_view word; TokenType type; } keywords[] = {
             {"true", TokenType::TRUE},
             {"false", TokenType::FALSE},
             {"null", TokenType::TYPE},
@@ -63,16 +67,34 @@ public:
             {"fn", TokenType::FUNCTION},
             {"return", TokenType::RETURN},
         };
+
+        for (const auto& k : keywords) {
+            if (k.word == word) {
+                type = k.type;
+                return true;
+            }
+        }
+        return false;
     }
 
-    std::vector<Token> generate() {
-        std::vector<Token> tokens;
+public:
+    // the source is copied into the arena so tokens can slice it directly
+    Lexer(const std::string& src, Arena& arena)
+        : arena(arena), source(arena.copy(src)), position(0), current(source.empty() ? '\0' : source[0]) {}
+
+    TokenList generate() {
+        TokenList tokens{ArenaAllocator<Token>(arena)};
+        tokens.reserve(source.size() / 3 + 1);
         
         while (not_end()) {
             if (std::isspace(current)) {
                 advance();
                 continue;
             } else {
+                tl = l;
+                tc = c;
+                start = position;
+
                 switch (current) {
                     case '+':
                         advance();
@@ -100,12 +122,6 @@ public:
                             while (not_end() && current != '\n') {
                                 advance();
                             }
-
-                            if (current == '\n') { 
-                                l++; 
-                                c = 1; 
-                                advance(); 
-                            }
                         } else {
                             tokens.emplace_back(nt(TokenType::OPERATOR, "/"));
                         }
@@ -114,7 +130,7 @@ public:
 
                     case '*':
                     case '%':
-                        tokens.emplace_back(nt(TokenType::OPERATOR, std::string(1, current)));
+                        tokens.emplace_back(nt(TokenType::OPERATOR, source.substr(position, 1)));
                         advance();
                         break;
 
@@ -200,52 +216,43 @@ public:
 
                     case '"': {
                         advance();
-                        std::string value;
+                        size_t body = position;
+                        bool escaped = false;
                         while (not_end() && current != '"') {
                             if (current == '\\') {
+                                escaped = true;
                                 advance();
-                                switch (current) {
-                                    case 'n': value += '\n'; break;
-                                    case 't': value += '\t'; break;
-                                    case 'r': value += '\r'; break;
-                                    case '"': value += '"'; break;
-                                    case '\\': value += '\\'; break;
-                                    default: value += current;
-                                }
-                            } else {
-                                value += current;
                             }
                             advance();
                         }
 
-                        if (current == '"') {
-                            advance();
-                            tokens.emplace_back(nt(TokenType::STRING, value));
-                        } else {
+                        if (current != '"') {
                             throw Error("Unterminated string literal.");
                         }
-                        
+
+                        std::string_view raw = source.substr(body, position - body);
+                        advance();
+
+                        // literals without escapes are sliced straight out of the source
+                        tokens.emplace_back(nt(TokenType::STRING, escaped ? unescape(raw) : raw));
                         break;
                     }
 
                     default:
                         if (std::isdigit(current)) {
-                            std::string value;
                             while (not_end() && std::isdigit(current)) {
-                                value.push_back(current);
                                 advance();
                             }
-                            tokens.emplace_back(nt(TokenType::NUMBER, value));
+                            tokens.emplace_back(nt(TokenType::NUMBER, lexeme()));
                         } else if (std::isalpha(current) || current == '_') {
-                            std::string value;
                             while (not_end() && (std::isalpha(current) || current == '_')) {
-                                value.push_back(current);
                                 advance();
                             }
                             
-                            auto keyword = keywords.find(value);
-                            if (keyword != keywords.end()) {
-                                tokens.emplace_back(nt(keyword->second, value));
+                            std::string_view value = lexeme();
+                            TokenType type;
+                            if (keyword(value, type)) {
+                                tokens.emplace_back(nt(type, value));
                             } else {
                                 tokens.emplace_back(nt(TokenType::IDENTIFIER, value));
                             }
@@ -258,13 +265,39 @@ public:
             }
         }
         
+        tl = l;
+        tc = c;
         tokens.emplace_back(nt(TokenType::EOS, ""));
         return tokens;
     }
 
 private:
-    Token nt(const TokenType& type, const std::string& value) const {
-        return Token(type, value, l, c);
+    Token nt(const TokenType& type, std::string_view value) const {
+        return Token(type, value, tl, tc);
+    }
+
+    std::string_view lexeme() const {
+        return source.substr(start, position - start);
+    }
+
+    std::string_view unescape(std::string_view raw) {
+        char* out = static_cast<char*>(arena.alloc(raw.size(), 1));
+        size_t n = 0;
+
+        for (size_t i = 0; i < raw.size(); i++) {
+            char ch = raw[i];
+            if (ch == '\\' && i + 1 < raw.size()) {
+                switch (raw[++i]) {
+                    case 'n': ch = '\n'; break;
+                    case 't': ch = '\t'; break;
+                    case 'r': ch = '\r'; break;
+                    default: ch = raw[i];
+                }
+            }
+            out[n++] = ch;
+        }
+
+        return std::string_view(out, n);
     }
 
     bool not_end() {
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct SourcePos {
+    uint32_t line = 0;
+    uint32_t col = 0;
+
+    std::string to_string() const {
+        return std::to_string(line) + ":" + std::to_string(col);
+    }
+};
+
+// pc -> source position table. rows are only added when the position changes,
+// each row is stored as three varints: pc delta, zigzag line delta and zigzag
+// column delta. it lives next to the bytecode and is only decoded when an error
+// or a profile needs a source location.
+class LineTable {
+private:
+    std::vector<uint8_t> data;
+
+    // encoder state
+    uint32_t  last_pc = 0;
+    SourcePos last;
+    bool      has_rows = false;
+
+    void put(uint32_t v) {
+        while (v >= 0x80) {
+            data.push_back(static_cast<uint8_t>(v | 0x80));
+            v >>= 7;
+        }
+        data.push_back(static_cast<uint8_t>(v));
+    }
+
+    void put_signed(int64_t v) {
+        put(static_cast<uint32_t>((static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63)));
+    }
+
+    static bool get(const std::vector<uint8_t>& d, size_t& i, uint32_t& out) {
+        out = 0;
+        for (int shift = 0; shift < 35; shift += 7) {
+            if (i >= d.size()) return false;
+            uint8_t b = d[i++];
+            out |= static_cast<uint32_t>(b & 0x7F) << shift;
+            if (!(b & 0x80)) return true;
+        }
+        return false;
+    }
+
+    static bool get_signed(const std::vector<uint8_t>& d, size_t& i, int64_t& out) {
+        uint32_t v;
+        if (!get(d, i, v)) return false;
+        out = static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+        return true;
+    }
+
+public:
+    LineTable() = default;
+    explicit LineTable(std::vector<uint8_t> bytes) : data(std::move(bytes)) {}
+
+    // records that code starting at pc came from pos. pcs must not decrease.
+    void add(uint32_t pc, SourcePos pos) {
+        if (has_rows && pos.line == last.line && pos.col == last.col) return;
+
+        put(pc - last_pc);
+        put_signed(static_cast<int64_t>(pos.line) - last.line);
+        put_signed(static_cast<int64_t>(pos.col) - last.col);
+
+        last_pc = pc;
+        last = pos;
+        has_rows = true;
+    }
+
+    bool lookup(size_t pc, SourcePos& out) const {
+        size_t    i = 0;
+        uint32_t  row_pc = 0;
+        SourcePos row;
+        bool      found = false;
+
+        while (i < data.size()) {
+            uint32_t pc_delta;
+            int64_t  line_delta, col_delta;
+            if (!get(data, i, pc_delta) || !get_signed(data, i, line_delta) || !get_signed(data, i, col_delta)) {
+                break;
+            }
+
+            row_pc += pc_delta;
+            if (row_pc > pc) break;
+
+            row.line = static_cast<uint32_t>(row.line + line_delta);
+            row.col = static_cast<uint32_t>(row.col + col_delta);
+            found = true;
+        }
+
+        if (found) out = row;
+        return found;
+    }
+
+    // drops every row, keeping the buffer for the next table
+    void clear() {
+        data.clear();
+        last_pc = 0;
+        last = SourcePos();
+        has_rows = false;
+    }
+
+    // adds every row of other, with its pcs moved up by base. base must not be
+    // below the last pc added here.
+    void append(const LineTable& other, uint32_t base) {
+        size_t    i = 0;
+        uint32_t  row_pc = 0;
+        SourcePos row;
+
+        while (i < other.data.size()) {
+            uint32_t pc_delta;
+            int64_t  line_delta, col_delta;
+            if (!get(other.data, i, pc_delta) || !get_signed(other.data, i, line_delta) ||
+                !get_signed(other.data, i, col_delta)) {
+                break;
+            }
+
+            row_pc += pc_delta;
+            row.line = static_cast<uint32_t>(row.line + line_delta);
+            row.col = static_cast<uint32_t>(row.col + col_delta);
+            add(base + row_pc, row);
+        }
+    }
+
+    const std::vector<uint8_t>& bytes() const { return data; }
+    bool empty() const { return data.empty(); }
+};
@@ -1,26 +1,180 @@
+#include <algorithm>
+#include <cstdio>
 #include <iostream>
 #include <string>
 #include <fstream>
 #include <sstream>
+#include "batch.hpp"
+#include "cache.hpp"
 #include "compiler.hpp"
 #include "cvm.hpp"
 
-void execute_code(const std::string& code, bool debug, bool show_last) {
+struct Options {
+    bool        debug = false;
+    bool        show_last = false;
+    bool        use_cache = true;
+    bool        gc_stats = false;
+    bool        profile = false;
+    std::string samples;          // folded stacks go here when set
+    uint64_t    sample_hz = 997;  // off the round numbers so it does not run in step with the script
+    bool        use_pool = true;
+    size_t      max_heap = 0;
+    std::string output;
+    std::string snapshot;
+    std::string batch_dir;
+    size_t      jobs = 0;
+    uint64_t    fuel = 0;    // 0 = no budget
+    uint64_t    slice = 0;
+};
+
+// "64k", "16m", "1g" or plain bytes
+size_t parse_size(const std::string& text) {
+    size_t end = 0;
+    unsigned long long value = std::stoull(text, &end);
+    std::string suffix = text.substr(end);
+
+    if (suffix == "k" || suffix == "K") value <<= 10;
+    else if (suffix == "m" || suffix == "M") value <<= 20;
+    else if (suffix == "g" || suffix == "G") value <<= 30;
+    else if (!suffix.empty()) throw std::runtime_error("Invalid size '" + text + "'");
+
+    return static_cast<size_t>(value);
+}
+
+Module compile_code(const std::string& code, size_t threads) {
+    Compiler compiler(code);
+    compiler.set_threads(threads);
+    Module module = compiler.compile();
+    module.source_hash = fnv1a(code);
+    return module;
+}
+
+void print_gc_stats(const GCStats& stats, const PoolStats& pool) {
+    print("gc: " + std::to_string(stats.minor_collections) + " minor, " +
+          std::to_string(stats.major_collections) + " major collections");
+    print("gc: " + std::to_string(stats.bytes_allocated) + " bytes allocated, " +
+          std::to_string(stats.bytes_promoted) + " promoted, " +
+          std::to_string(stats.bytes_freed) + " freed, " +
+          std::to_string(stats.old_bytes) + " old");
+    print("gc: " + std::to_string(stats.minor_ns / 1000) + "us minor, " +
+          std::to_string(stats.major_ns / 1000) + "us major, " +
+          std::to_string(stats.max_pause_ns / 1000) + "us max pause");
+    print("gc: " + std::to_string(stats.interned_strings) + " interned strings");
+
+    print("heap: " + std::to_string(stats.peak_bytes) + " bytes peak");
+    for (size_t i = 0; i < OBJ_KIND_COUNT; i++) {
+        print("heap: " + std::string(obj_kind_name(static_cast<ObjKind>(i))) + " " +
+              std::to_string(stats.allocated_by_kind[i]) + " bytes allocated, " +
+              std::to_string(stats.old_by_kind[i]) + " old");
+    }
+
+    if (pool.bytes_reserved > 0) {
+        size_t free_bytes = pool.bytes_reserved - pool.bytes_used;
+        print("pool: " + std::to_string(pool.allocations) + " allocations, " +
+              std::to_string(pool.bytes_reserved) + " bytes in pages, " +
+              std::to_string(pool.bytes_used) + " in use, " +
+              std::to_string(free_bytes * 100 / pool.bytes_reserved) + "% free");
+    }
+}
+
+// opcodes by time spent, then the pairs that ran back to back most often
+void print_profile(const OpcodeProfile& profile, uint64_t instructions) {
+    const size_t TOP_PAIRS = 20;
+    uint64_t total = std::max<uint64_t>(1, profile.total_ticks());
+    uint64_t count = std::max<uint64_t>(1, profile.total_count());
+    std::string unit = profile_tick_unit();
+    char line[160];
+
+    print("profile: " + std::to_string(instructions) + " instructions, " + std::to_string(profile.total_ticks()) + " " + unit);
+    std::snprintf(line, sizeof(line), "profile: %-14s %12s %7s %16s %7s %10s", "opcode", "count", "%", unit.c_str(), "%",
+                  (unit + "/op").c_str());
+    print(line);
+    for (const auto& row : profile.rows()) {
+        std::snprintf(line, sizeof(line), "profile: %-14s %12llu %6.2f%% %16llu %6.2f%% %10.1f",
+                      op_as_string(static_cast<OpCode>(row.op)).c_str(), static_cast<unsigned long long>(row.count),
+                      100.0 * row.count / count, static_cast<unsigned long long>(row.ticks), 100.0 * row.ticks / total,
+                      static_cast<double>(row.ticks) / row.count);
+        print(line);
+    }
+
+    print("profile: most frequent pairs");
+    for (const auto& pair : profile.top_pairs(TOP_PAIRS)) {
+        std::string name = op_as_string(static_cast<OpCode>(pair.first)) + " " + op_as_string(static_cast<OpCode>(pair.second));
+        std::snprintf(line, sizeof(line), "profile: %-28s %12llu %6.2f%%", name.c_str(),
+                      static_cast<unsigned long long>(pair.count), 100.0 * pair.count / count);
+        print(line);
+    }
+}
+
+void write_samples(const CVM& vm, const std::string& path) {
+    std::ofstream file(path);
+    if (!file.is_open()) {
+        print("error: could not open file '" + path + "'");
+        return;
+    }
+
+    vm.write_samples(file);
+    print("wrote " + std::to_string(vm.stack_sampler()->samples()) + " samples: " + path);
+}
+
+HeapConfig heap_config(const Options& opts) {
+    HeapConfig config;
+    config.memory_limit = opts.max_heap;
+    config.use_pool = opts.use_pool;
+    return config;
+}
+
+void run_vm(CVM& vm, const Options& opts) {
+    vm.set_parallelism(opts.jobs);
+    if (!opts.snapshot.empty()) vm.set_snapshot_path(opts.snapshot);
+    if (opts.fuel) vm.set_fuel(opts.fuel);
+    vm.set_profiling(opts.profile);
+    if (!opts.samples.empty()) vm.set_sampling(std::chrono::microseconds(1000000 / opts.sample_hz));
+
+    // stats are reported even when the script fails, a heap limit error is
+    // exactly when the high water mark is interesting
     try {
-        Lexer lexer(code);
-        auto tokens = lexer.generate();
-        Compiler compiler(tokens);
-        auto bytecode = compiler.compile();
-        CVM vm(bytecode, debug);
-        vm.execute();
-        
-        if (show_last) print("result: " + vm.getResultAsString());
+        if (!vm.execute()) print("error: fuel budget of " + std::to_string(opts.fuel) + " exhausted.");
+        else if (vm.wrote_snapshot()) print("wrote snapshot: " + opts.snapshot);
+        else if (opts.show_last) print("result: " + vm.getResultAsString());
+    } catch (const std::exception& e) {
+        print("error: " + std::string(e.what()));
+    }
+
+    if (opts.gc_stats) print_gc_stats(vm.gc_stats(), vm.pool_stats());
+    if (opts.profile) print_profile(*vm.opcode_profile(), vm.instructions());
+    if (!opts.samples.empty()) write_samples(vm, opts.samples);
+}
+
+void execute_module(const ProgramRef& program, const Options& opts) {
+    try {
+        CVM vm(program, opts.debug, heap_config(opts));
+        run_vm(vm, opts);
     } catch (const std::exception& e) {
         print("error: " + std::string(e.what()));
     }
 }
 
-void repl_mode(bool debug, bool show_last) {
+// picks up a vm where checkpoint() left it, straight from the mapped file
+void resume_snapshot(const std::string& filename, const Options& opts) {
+    try {
+        std::unique_ptr<CVM> vm = CVM::restore(filename, opts.debug, heap_config(opts));
+        print("resuming snapshot: " + filename);
+        run_vm(*vm, opts);
+    } catch (const std::exception& e) {
+        print("error: " + std::string(e.what()));
+    }
+}
+
+void execute_code(const std::string& code, const Options& opts) {
+    try {
+        execute_module(make_program(compile_code(code, opts.jobs)), opts);
+    } catch (const std::exception& e) {
+        print("error: " + std::string(e.what()));
+    }
+}
+
+void repl_mode(const Options& opts) {
     print("CVM REPL v0.1 (type 'exit();' to stop, 'help();' for commands)");
     
     while (true) {
@@ -47,38 +201,118 @@ void repl_mode(bool debug, bool show_last) {
             continue;
         }
 
-        execute_code(input, debug, show_last);
+        execute_code(input, opts);
     }
 }
 
-void file_mode(const std::string& filename, bool debug, bool show_last) {
-    std::ifstream file(filename);
+void file_mode(const std::string& filename, const Options& opts) {
+    std::ifstream file(filename, std::ios::binary);
     if (!file.is_open()) {
         print("error: could not open file '" + filename + "'");
         return;
     }
 
+    // snapshots are mapped rather than read
+    uint8_t magic[sizeof(SNAPSHOT_MAGIC)] = {};
+    if (file.read(reinterpret_cast<char*>(magic), sizeof(magic)) &&
+        SnapshotReader::is_snapshot(magic, sizeof(magic))) {
+        resume_snapshot(filename, opts);
+        return;
+    }
+    file.clear();
+    file.seekg(0);
+
     std::stringstream buffer;
     buffer << file.rdbuf();
     std::string content = buffer.str();
-    
-    print("executing file: " + filename);
-    execute_code(content, debug, show_last);
+
+    try {
+        Module module;
+        std::vector<uint8_t> raw(content.begin(), content.end());
+
+        if (ModuleReader::is_module(raw)) {
+            // precompiled module, skip the front end entirely
+            module = ModuleReader(raw).read();
+        } else {
+            ModuleCache cache;
+            if (!opts.use_cache || !cache.load(content, module)) {
+                module = compile_code(content, opts.jobs);
+                if (opts.use_cache) cache.store(content, module);
+            }
+        }
+
+        module.source_name = filename;
+
+        if (!opts.output.empty()) {
+            std::ofstream out(opts.output, std::ios::binary | std::ios::trunc);
+            if (!out.is_open()) {
+                print("error: could not write '" + opts.output + "'");
+                return;
+            }
+
+            ModuleWriter().write(module, out);
+            print("wrote module: " + opts.output);
+            return;
+        }
+
+        print("executing file: " + filename);
+        execute_module(make_program(std::move(module)), opts);
+    } catch (const std::exception& e) {
+        print("error: " + std::string(e.what()));
+    }
+}
+
+std::string format_ms(uint64_t ns) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.2fms", ns / 1e6);
+    return buf;
+}
+
+void batch_mode(const Options& opts) {
+    BatchOptions batch;
+    batch.workers = opts.jobs;
+    batch.use_cache = opts.use_cache;
+    batch.heap.memory_limit = opts.max_heap;
+    if (opts.max_heap) batch.max_output = opts.max_heap;  // output is held in memory too
+    batch.heap.use_pool = opts.use_pool;
+    batch.quota = opts.fuel;
+    batch.slice = opts.slice;
+
+    std::vector<std::string> paths = BatchExecutor::collect(opts.batch_dir);
+    BatchReport report = BatchExecutor(batch).run(paths);
+
+    // per script output, in path order, after everything has run
+    for (const auto& r : report.results) {
+        std::cout << "== " << r.path << (r.ok ? "" : " (failed)") << "\n";
+        std::cout << r.output << r.error;
+    }
+    std::cout.flush();
+
+    char rate[32];
+    std::snprintf(rate, sizeof(rate), "%.1f", report.throughput);
+    print("batch: " + std::to_string(report.results.size()) + " scripts, " +
+          std::to_string(report.failed) + " failed, " + format_ms(report.wall_seconds * 1e9) +
+          " wall, " + rate + " scripts/s");
+    print("batch: latency p50 " + format_ms(report.p50_ns) + ", p90 " + format_ms(report.p90_ns) +
+          ", p99 " + format_ms(report.p99_ns) + ", max " + format_ms(report.max_ns));
 }
 
 void print_usage(const char* program_name) {
-    std::cout << "Usage: " << program_name << " [-d] [filename]\n";
+    std::cout << "Usage: " << program_name << " [-d] [-s] [-p] [--sample out.folded] [--sample-hz n] [-o out.catc] [--snapshot out.cats] [--no-cache] [--gc-stats] [--max-heap size] [--no-pool] [--fuel n] [-j n] [--batch dir] [--slice n] [filename]\n";
     std::cout << "  If no filename is provided, starts in REPL mode\n";
+    std::cout << "  -o writes the compiled module instead of running it, .catc files run directly\n";
+    std::cout << "  --snapshot makes checkpoint() save the vm and stop, running the .cats file resumes it\n";
+    std::cout << "  --batch runs every script under dir on -j worker threads (default: all cores)\n";
+    std::cout << "  -j also caps the threads pmap, parallel_for and the compiler use in a single script\n";
+    std::cout << "  -p prints how often each opcode ran and the time it took, and the most frequent opcode pairs\n";
+    std::cout << "  --sample writes sampled call stacks (default 997 per second) as folded stacks for flamegraph.pl or speedscope\n";
+    std::cout << "  --fuel stops a script after n calls, spawns and channel waits\n";
+    std::cout << "  --slice makes batch workers round robin their scripts, n units of fuel per turn\n";
+    std::cout << "  --max-heap caps the script's heap (e.g. 64m), exceeding it is a runtime error\n";
 }
 
 int main(int argc, char* argv[]) {
-    bool debug_mode = false;
-    bool show_last = false;
-
-    if (argc > 3) {
-        print_usage(argv[0]);
-        return 1;
-    }
+    Options opts;
 
     try {
         for (int i = 1; i < argc; ++i) {
@@ -88,22 +322,92 @@ int main(int argc, char* argv[]) {
                 return 0;
             }
             else if (arg == "-d") {
-                debug_mode = true;
+                opts.debug = true;
             }
             else if (arg == "-s") {
-                show_last = true;
+                opts.show_last = true;
+            }
+            else if (arg == "-p") {
+                opts.profile = true;
+            }
+            else if (arg == "--no-cache") {
+                opts.use_cache = false;
+            }
+            else if (arg == "--gc-stats") {
+                opts.gc_stats = true;
+            }
+            else if (arg == "--batch" || arg == "-j") {
+                if (i + 1 >= argc) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+
+                if (arg == "--batch") opts.batch_dir = argv[++i];
+                else opts.jobs = std::stoul(argv[++i]);
+            }
+            else if (arg == "--no-pool") {
+                opts.use_pool = false;
+            }
+            else if (arg == "--fuel" || arg == "--slice") {
+                if (i + 1 >= argc) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+
+                if (arg == "--fuel") opts.fuel = std::stoull(argv[++i]);
+                else opts.slice = std::stoull(argv[++i]);
+            }
+            else if (arg == "--max-heap") {
+                if (i + 1 >= argc) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                opts.max_heap = parse_size(argv[++i]);
+            }
+            else if (arg == "--sample-hz") {
+                if (i + 1 >= argc) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+
+                std::string hz = argv[++i];
+                opts.sample_hz = std::stoull(hz);
+                // the ticker sleeps whole microseconds between samples
+                if (opts.sample_hz == 0 || opts.sample_hz > 1000000) {
+                    throw std::runtime_error("Invalid sample rate '" + hz + "', expected 1 to 1000000");
+                }
+            }
+            else if (arg == "-o" || arg == "--snapshot" || arg == "--sample") {
+                if (i + 1 >= argc) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+
+                if (arg == "-o") opts.output = argv[++i];
+                else if (arg == "--sample") opts.samples = argv[++i];
+                else opts.snapshot = argv[++i];
             }
             else {
                 if (i != argc - 1) {
                     print_usage(argv[0]);
                     return 1;
                 }
-                file_mode(arg, debug_mode, show_last);
+                file_mode(arg, opts);
                 return 0;
             }
         }
 
-        repl_mode(debug_mode, show_last);
+        if (!opts.batch_dir.empty()) {
+            batch_mode(opts);
+            return 0;
+        }
+
+        if (!opts.output.empty()) {
+            print_usage(argv[0]);
+            return 1;
+        }
+
+        repl_mode(opts);
     } catch (const std::exception& e) {
         print("fatal error: " + std::string(e.what()));
         return 1;
@@ -0,0 +1,304 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include "ctypes.hpp"
+#include "lines.hpp"
+
+// compiled module (.catc) format, all integers little endian:
+//
+//   magic        "CATC"
+//   version      u16
+//   revision     u16     BYTECODE_REVISION of the compiler that wrote it
+//   flags        u16     MODULE_HAS_DEBUG
+//   source_hash  u64     fnv1a of the source the module was compiled from
+//   constants    u32 count, then { u32 len, bytes }
+//   functions    u32 count, then { u16 len, name, u8 ret, u8 argc, u8 types[argc], u32 offset, u8 locals }
+//   natives      u32 count, then { u16 len, name, u8 ret, u8 argc, u8 types[argc] }
+//   code         u32 len, bytes
+//   debug        only when MODULE_HAS_DEBUG is set:
+//                u32 len, source name
+//                u32 len, line table (see lines.hpp)
+//   checksum     u64     fnv1a of everything above
+
+static const char     MODULE_MAGIC[4] = {'C', 'A', 'T', 'C'};
+static const uint16_t MODULE_VERSION  = 4;
+// the version covers the file layout, the revision the code inside it. bump it
+// whenever the compiler emits different bytecode for the same source, or the vm
+// reads an opcode differently, so cached modules from older builds are rejected.
+static const uint16_t BYTECODE_REVISION = 5;
+static const uint16_t MODULE_HAS_DEBUG = 0x0001;
+
+inline uint64_t fnv1a(const uint8_t* data, size_t len, uint64_t hash = 0xCBF29CE484222325ULL) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+inline uint64_t fnv1a(const std::string& s) {
+    return fnv1a(reinterpret_cast<const uint8_t*>(s.data()), s.size());
+}
+
+struct FunctionInfo {
+    std::string       name;
+    Type              return_type = Type::VOID;
+    std::vector<Type> param_types;
+    uint32_t          offset = 0;
+    uint8_t           local_count = 0;
+};
+
+// a host function the module calls, CALLNATIVE operands index this table
+struct NativeImport {
+    std::string       name;
+    Type              return_type = Type::VOID;
+    std::vector<Type> param_types;
+};
+
+struct Module {
+    uint64_t                  source_hash = 0;
+    std::vector<std::string>  constants;
+    std::vector<FunctionInfo> functions;
+    std::vector<NativeImport> natives;
+    std::vector<uint8_t>      code;
+
+    // debug info, optional
+    std::string               source_name;
+    LineTable                 lines;
+
+    bool has_debug() const { return !source_name.empty() || !lines.empty(); }
+
+    // "file:line:col" for the instruction at pc, or "ip=pc" without debug info
+    std::string describe(size_t pc) const {
+        SourcePos pos;
+        if (!lines.lookup(pc, pos)) return "ip=" + std::to_string(pc);
+        return (source_name.empty() ? "<input>" : source_name) + ":" + pos.to_string();
+    }
+};
+
+class ModuleWriter {
+private:
+    std::vector<uint8_t> out;
+
+    void u8(uint8_t v) { out.push_back(v); }
+
+    void u16(uint16_t v) {
+        u8(v & 0xFF);
+        u8((v >> 8) & 0xFF);
+    }
+
+    void u32(uint32_t v) {
+        for (int i = 0; i < 4; i++) u8((v >> (i * 8)) & 0xFF);
+    }
+
+    void u64(uint64_t v) {
+        for (int i = 0; i < 8; i++) u8((v >> (i * 8)) & 0xFF);
+    }
+
+    void bytes(const void* data, size_t len) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        out.insert(out.end(), p, p + len);
+    }
+
+public:
+    std::vector<uint8_t> write(const Module& module) {
+        out.clear();
+
+        bytes(MODULE_MAGIC, sizeof(MODULE_MAGIC));
+        u16(MODULE_VERSION);
+        u16(BYTECODE_REVISION);
+        u16(module.has_debug() ? MODULE_HAS_DEBUG : 0);
+        u64(module.source_hash);
+
+        u32(module.constants.size());
+        for (const auto& k : module.constants) {
+            u32(k.size());
+            bytes(k.data(), k.size());
+        }
+
+        u32(module.functions.size());
+        for (const auto& f : module.functions) {
+            if (f.name.size() > 0xFFFF || f.param_types.size() > 0xFF) {
+                throw std::runtime_error("Function '" + f.name + "' cannot be encoded.");
+            }
+
+            u16(f.name.size());
+            bytes(f.name.data(), f.name.size());
+            u8(static_cast<uint8_t>(f.return_type));
+            u8(f.param_types.size());
+            for (Type t : f.param_types) u8(static_cast<uint8_t>(t));
+            u32(f.offset);
+            u8(f.local_count);
+        }
+
+        u32(module.natives.size());
+        for (const auto& n : module.natives) {
+            u16(n.name.size());
+            bytes(n.name.data(), n.name.size());
+            u8(static_cast<uint8_t>(n.return_type));
+            u8(n.param_types.size());
+            for (Type t : n.param_types) u8(static_cast<uint8_t>(t));
+        }
+
+        u32(module.code.size());
+        bytes(module.code.data(), module.code.size());
+
+        if (module.has_debug()) {
+            u32(module.source_name.size());
+            bytes(module.source_name.data(), module.source_name.size());
+            u32(module.lines.bytes().size());
+            bytes(module.lines.bytes().data(), module.lines.bytes().size());
+        }
+
+        u64(fnv1a(out.data(), out.size()));
+        return out;
+    }
+
+    void write(const Module& module, std::ostream& os) {
+        std::vector<uint8_t> data = write(module);
+        os.write(reinterpret_cast<const char*>(data.data()), data.size());
+    }
+};
+
+class ModuleReader {
+private:
+    const std::vector<uint8_t>& in;
+    size_t                      pos = 0;
+
+    void need(size_t n) {
+        if (in.size() - pos < n) {
+            throw std::runtime_error("Truncated module.");
+        }
+    }
+
+    uint8_t u8() {
+        need(1);
+        return in[pos++];
+    }
+
+    uint16_t u16() {
+        uint16_t v = u8();
+        return v | (u8() << 8);
+    }
+
+    uint32_t u32() {
+        uint32_t v = 0;
+        for (int i = 0; i < 4; i++) v |= static_cast<uint32_t>(u8()) << (i * 8);
+        return v;
+    }
+
+    uint64_t u64() {
+        uint64_t v = 0;
+        for (int i = 0; i < 8; i++) v |= static_cast<uint64_t>(u8()) << (i * 8);
+        return v;
+    }
+
+    std::string str(size_t len) {
+        need(len);
+        std::string s(reinterpret_cast<const char*>(&in[pos]), len);
+        pos += len;
+        return s;
+    }
+
+    uint64_t peek_checksum() const {
+        uint64_t v = 0;
+        for (int i = 0; i < 8; i++) v |= static_cast<uint64_t>(in[in.size() - 8 + i]) << (i * 8);
+        return v;
+    }
+
+    Type type() {
+        uint8_t t = u8();
+        if (t > static_cast<uint8_t>(Type::VOID)) {
+            throw std::runtime_error("Invalid type in module.");
+        }
+        return static_cast<Type>(t);
+    }
+
+public:
+    explicit ModuleReader(const std::vector<uint8_t>& data) : in(data) {}
+
+    static bool is_module(const std::vector<uint8_t>& data) {
+        return data.size() >= sizeof(MODULE_MAGIC) &&
+               std::equal(MODULE_MAGIC, MODULE_MAGIC + sizeof(MODULE_MAGIC), data.begin());
+    }
+
+    Module read() {
+        if (!is_module(in)) {
+            throw std::runtime_error("Not a cvm module.");
+        }
+
+        if (in.size() < 8 || fnv1a(in.data(), in.size() - 8) != peek_checksum()) {
+            throw std::runtime_error("Module checksum mismatch.");
+        }
+
+        pos = sizeof(MODULE_MAGIC);
+        uint16_t version = u16();
+        if (version != MODULE_VERSION) {
+            throw std::runtime_error("Unsupported module version " + std::to_string(version) + ".");
+        }
+
+        uint16_t revision = u16();
+        if (revision != BYTECODE_REVISION) {
+            throw std::runtime_error("Module was compiled for bytecode revision " + std::to_string(revision) +
+                                     ", this build runs " + std::to_string(BYTECODE_REVISION) + ".");
+        }
+
+        uint16_t flags = u16();
+        Module module;
+        module.source_hash = u64();
+
+        uint32_t n_consts = u32();
+        for (uint32_t i = 0; i < n_consts; i++) {
+            module.constants.push_back(str(u32()));
+        }
+
+        uint32_t n_funcs = u32();
+        for (uint32_t i = 0; i < n_funcs; i++) {
+            FunctionInfo f;
+            f.name = str(u16());
+            f.return_type = type();
+            uint8_t argc = u8();
+            for (uint8_t a = 0; a < argc; a++) f.param_types.push_back(type());
+            f.offset = u32();
+            f.local_count = u8();
+            module.functions.push_back(std::move(f));
+        }
+
+        uint32_t n_natives = u32();
+        for (uint32_t i = 0; i < n_natives; i++) {
+            NativeImport n;
+            n.name = str(u16());
+            n.return_type = type();
+            uint8_t argc = u8();
+            for (uint8_t a = 0; a < argc; a++) n.param_types.push_back(type());
+            module.natives.push_back(std::move(n));
+        }
+
+        uint32_t code_len = u32();
+        need(code_len);
+        module.code.assign(in.begin() + pos, in.begin() + pos + code_len);
+        pos += code_len;
+
+        if (flags & MODULE_HAS_DEBUG) {
+            module.source_name = str(u32());
+            std::string table = str(u32());
+            module.lines = LineTable(std::vector<uint8_t>(table.begin(), table.end()));
+        }
+
+        return module;
+    }
+
+    static Module read(std::istream& is) {
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+        return ModuleReader(data).read();
+    }
+};
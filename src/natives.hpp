@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "ctypes.hpp"
+#include "heap.hpp"
+#include "module.hpp"
+#include "strings.hpp"
+
+// the arguments of one native call. they are the caller's stack slots, nothing
+// is copied; the compiler has already checked them against the signature.
+class NativeArgs {
+private:
+    const Value* args;
+    size_t       count;
+    Heap&        h;
+
+public:
+    NativeArgs(const Value* args, size_t count, Heap& heap) : args(args), count(count), h(heap) {}
+
+    size_t size() const { return count; }
+    const Value& operator[](size_t i) const { return args[i]; }
+
+    int integer(size_t i) const { return args[i].ivalue; }
+    bool boolean(size_t i) const { return args[i].bvalue; }
+    const ArrayObject* array(size_t i) const { return args[i].avalue; }
+
+    // flattens a rope argument in place, the view lives as long as the call
+    std::string_view string(size_t i) const { return flatten(h, args[i].svalue)->view(); }
+
+    // results are built on the calling vm's heap. allocating never collects, so
+    // the arguments stay valid for the whole call.
+    Heap& heap() const { return h; }
+    Value make_string(std::string_view text) const { return Value(h.make_string(text)); }
+};
+
+using NativeFn = std::function<Value(NativeArgs&)>;
+
+struct NativeFunction {
+    std::string       name;
+    Type              return_type = Type::VOID;
+    std::vector<Type> param_types;
+    NativeFn          fn;
+    bool              pure = false;  // callable from pmap workers, so fn must be thread safe
+};
+
+// host functions a script can call by name. the host fills a registry before
+// compiling and hands the same one to every vm that runs the result; modules
+// import natives by name and signature, so a registry only has to agree with
+// the one a module was compiled against on the functions it actually uses.
+class NativeRegistry {
+private:
+    std::vector<NativeFunction>             functions;
+    std::unordered_map<std::string, size_t> index;
+
+public:
+    // returns the function's index in this registry
+    size_t add(const std::string& name, Type return_type, std::vector<Type> param_types, NativeFn fn,
+               bool pure = false) {
+        if (index.count(name)) {
+            throw std::runtime_error("Native function '" + name + "' already registered.");
+        }
+        if (param_types.size() > 0xFF) {
+            throw std::runtime_error("Native function '" + name + "' has too many parameters.");
+        }
+        for (Type t : param_types) {
+            if (t == Type::VOID) throw std::runtime_error("Native function '" + name + "' has a void parameter.");
+        }
+
+        functions.push_back({name, return_type, std::move(param_types), std::move(fn), pure});
+        index[name] = functions.size() - 1;
+        return functions.size() - 1;
+    }
+
+    const NativeFunction* find(std::string_view name) const {
+        auto it = index.find(std::string(name));
+        return it == index.end() ? nullptr : &functions[it->second];
+    }
+
+    const NativeFunction& at(size_t i) const { return functions[i]; }
+    size_t size() const { return functions.size(); }
+
+    // fnv1a over every name and signature, compiled modules are cached per registry
+    uint64_t signature() const {
+        uint64_t hash = fnv1a(nullptr, 0);
+        for (const auto& f : functions) {
+            hash = fnv1a(reinterpret_cast<const uint8_t*>(f.name.data()), f.name.size(), hash);
+            uint8_t types[2] = {static_cast<uint8_t>(f.return_type), static_cast<uint8_t>(f.pure)};
+            hash = fnv1a(types, sizeof(types), hash);
+            for (Type t : f.param_types) {
+                uint8_t b = static_cast<uint8_t>(t);
+                hash = fnv1a(&b, 1, hash);
+            }
+        }
+        return hash;
+    }
+
+    // the native behind a module's import, checked against what the compiler saw
+    const NativeFunction& resolve(const NativeImport& import) const {
+        const NativeFunction* f = find(import.name);
+        if (!f) {
+            throw std::runtime_error("Native function '" + import.name + "' is not registered.");
+        }
+        if (f->return_type != import.return_type || f->param_types != import.param_types) {
+            throw std::runtime_error("Native function '" + import.name + "' does not match the signature it was compiled against.");
+        }
+        return *f;
+    }
+};
+
+using NativeRegistryRef = std::shared_ptr<const NativeRegistry>;
@@ -21,6 +21,7 @@ enum class OpCode : uint8_t {
 
     CONCAT = 0x0E,
     PRINT  = 0x0F,
+    PUSHS  = 0x10, // push string from the constant pool
 
     MKARR  = 0x20,
     MKVEC  = 0x21,
@@ -44,6 +45,41 @@ enum class OpCode : uint8_t {
     CALL   = 0x36,
     ENTER  = 0x37, // enter functions frame
 
+    // int array builtins, see simd.hpp
+    ASUM   = 0x38, // sum(a)
+    AMIN   = 0x39, // min(a)
+    AMAX   = 0x3A, // max(a)
+    AFIND  = 0x3B, // indexOf(a, x)
+    ACOUNT = 0x3C, // count(a, x)
+    AFILL  = 0x3D, // fill(a, x), in place
+    AADD   = 0x3E, // add(a, x or b), in place
+    AMUL   = 0x3F, // mul(a, x or b), in place
+
+    SETIDX_LOCAL = 0x40, // slot: locals[slot][i] = v, the array is not pushed first
+    GETIDX_LOCAL = 0x41, // slot: push locals[slot][i]
+
+    // green threads
+    SPAWN  = 0x42, // off32 argc: start a task running the function at off, push its handle
+    YIELD  = 0x43, // let the next ready task run
+    JOIN   = 0x44, // wait for the task whose handle is on the stack, push its result
+
+    // async file io, both push a handle for JOIN
+    READF  = 0x45, // read_file(path)
+    WRITEF = 0x46, // write_file(path, text)
+
+    // parallel builtins: off32 param_type ret_type, the function runs on worker vms
+    PMAP   = 0x47, // pmap(a, fn), pushes a new array
+    PFOR   = 0x48, // parallel_for(a, fn), in place
+
+    // channels between vms, see channel.hpp
+    CHOPEN = 0x49, // channel(name), pushes a handle
+    CHSEND = 0x4A, // send(c, v)
+    CHRECV = 0x4B, // recv(c), waits for a message
+    CHTRY  = 0x4C, // try_recv(c, fallback)
+
+    CALLNATIVE = 0x4D, // idx16 argc: call the module's native import idx on the top argc values
+    CHECKPOINT = 0x4E, // checkpoint(), snapshots the vm when the host asked for it
+
     HALT = 0x00,
 };
 
@@ -62,9 +98,51 @@ inline std::string op_as_string(const OpCode& opcode) {
         case OpCode::INC: return "INC";
         case OpCode::DEC: return "DEC";
         case OpCode::PUSHK: return "PUSHK";
+        case OpCode::PUSHS: return "PUSHS";
         case OpCode::NEG: return "NEG";
         case OpCode::JMP: return "JMP";
         case OpCode::JMPF: return "JMPF";
+        case OpCode::CONCAT: return "CONCAT";
+        case OpCode::PRINT: return "PRINT";
+        case OpCode::MKARR: return "MKARR";
+        case OpCode::MKVEC: return "MKVEC";
+        case OpCode::APUSH: return "APUSH";
+        case OpCode::GETIDX: return "GETIDX";
+        case OpCode::SETIDX: return "SETIDX";
+        case OpCode::ASIZE: return "ASIZE";
+        case OpCode::VBACK: return "VBACK";
+        case OpCode::GT: return "GT";
+        case OpCode::LT: return "LT";
+        case OpCode::GTE: return "GTE";
+        case OpCode::LTE: return "LTE";
+        case OpCode::EQ: return "EQ";
+        case OpCode::NEQ: return "NEQ";
+        case OpCode::RET: return "RET";
+        case OpCode::CALL: return "CALL";
+        case OpCode::ENTER: return "ENTER";
+        case OpCode::ASUM: return "ASUM";
+        case OpCode::AMIN: return "AMIN";
+        case OpCode::AMAX: return "AMAX";
+        case OpCode::AFIND: return "AFIND";
+        case OpCode::ACOUNT: return "ACOUNT";
+        case OpCode::AFILL: return "AFILL";
+        case OpCode::AADD: return "AADD";
+        case OpCode::AMUL: return "AMUL";
+        case OpCode::SETIDX_LOCAL: return "SETIDX_LOCAL";
+        case OpCode::GETIDX_LOCAL: return "GETIDX_LOCAL";
+        case OpCode::SPAWN: return "SPAWN";
+        case OpCode::YIELD: return "YIELD";
+        case OpCode::JOIN: return "JOIN";
+        case OpCode::READF: return "READF";
+        case OpCode::WRITEF: return "WRITEF";
+        case OpCode::PMAP: return "PMAP";
+        case OpCode::PFOR: return "PFOR";
+        case OpCode::CHOPEN: return "CHOPEN";
+        case OpCode::CHSEND: return "CHSEND";
+        case OpCode::CHRECV: return "CHRECV";
+        case OpCode::CHTRY: return "CHTRY";
+        case OpCode::CALLNATIVE: return "CALLNATIVE";
+        case OpCode::CHECKPOINT: return "CHECKPOINT";
         default: return "UNKNOWN";
     }
 }
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <charconv>
+#include <cstddef>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+// where buffered script output ends up
+class OutputSink {
+public:
+    virtual ~OutputSink() = default;
+    virtual void write(const char* data, size_t len) = 0;
+};
+
+class StreamSink : public OutputSink {
+private:
+    std::ostream& os;
+
+public:
+    explicit StreamSink(std::ostream& os = std::cout) : os(os) {}
+
+    void write(const char* data, size_t len) override {
+        os.write(data, len);
+        os.flush();
+    }
+};
+
+// keeps everything in memory, for embedders that want to capture output
+class MemorySink : public OutputSink {
+private:
+    std::string data;
+
+public:
+    void write(const char* d, size_t len) override { data.append(d, len); }
+
+    const std::string& contents() const { return data; }
+    void clear() { data.clear(); }
+};
+
+enum class FlushPolicy {
+    LINE,  // flush after every completed line
+    SIZE,  // flush once the buffer reaches the threshold
+    HALT,  // only flush when the vm halts, errors or flush() is called
+};
+
+class Output {
+private:
+    std::shared_ptr<OutputSink> sink;
+    std::string                 buffer;
+    FlushPolicy                 policy;
+    size_t                      threshold = 8192;
+    size_t                      limit = 0;    // bytes the sink may receive, 0 = no limit
+    size_t                      written = 0;
+
+public:
+    Output()
+        : sink(std::make_shared<StreamSink>()),
+          policy(isatty(STDOUT_FILENO) ? FlushPolicy::LINE : FlushPolicy::SIZE) {}
+
+    ~Output() { flush(); }
+
+    Output(const Output&) = delete;
+    Output& operator=(const Output&) = delete;
+
+    void set_sink(std::shared_ptr<OutputSink> s) {
+        flush();
+        sink = std::move(s);
+    }
+
+    void set_policy(FlushPolicy p, size_t size_threshold = 8192) {
+        policy = p;
+        threshold = size_threshold;
+    }
+
+    FlushPolicy get_policy() const { return policy; }
+
+    // output past the limit is cut off and the write that crossed it throws, so
+    // neither a script buffering until halt nor one huge print grows without bound
+    void set_limit(size_t bytes) { limit = bytes; }
+
+    // appends are cheap, callers write a whole record and then call end_record()
+    void write(const char* data, size_t len) {
+        if (limit && written + buffer.size() + len > limit) {
+            buffer.append(data, limit - written - buffer.size());
+            throw std::runtime_error("Output limit of " + std::to_string(limit) + " bytes exceeded");
+        }
+        buffer.append(data, len);
+    }
+
+    void write(const std::string& s) { write(s.data(), s.size()); }
+    void write(char c) { write(&c, 1); }
+
+    void write(int v) {
+        char tmp[16];
+        auto res = std::to_chars(tmp, tmp + sizeof(tmp), v);
+        write(tmp, res.ptr - tmp);
+    }
+
+    void end_record() {
+        switch (policy) {
+            case FlushPolicy::LINE:
+                if (!buffer.empty() && buffer.back() == '\n') flush();
+                break;
+            case FlushPolicy::SIZE:
+                if (buffer.size() >= threshold) flush();
+                break;
+            case FlushPolicy::HALT:
+                break;
+        }
+    }
+
+    void flush() {
+        if (buffer.empty() || !sink) return;
+        sink->write(buffer.data(), buffer.size());
+        written += buffer.size();
+        buffer.clear();
+    }
+};
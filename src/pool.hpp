@@ -0,0 +1,149 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+struct PoolStats {
+    size_t bytes_reserved = 0;  // pages taken from malloc
+    size_t bytes_used = 0;      // handed out, rounded up to the size class
+    size_t allocations = 0;
+};
+
+// size class segregated free lists for small old generation objects. classes are
+// 16 bytes apart up to MAX_SIZE, bigger requests go straight to malloc. a class
+// with an empty list carves its next slot from the current page, and freed slots
+// go to the front of their class list. pages are kept while the pool lives; when
+// it dies they go to a small per-thread cache, so the next vm on this thread
+// starts without touching malloc. a pool belongs to one heap and is never shared
+// between threads, so nothing here locks.
+class Pool {
+public:
+    static const size_t GRANULE  = 16;
+    static const size_t MAX_SIZE = 512;
+
+private:
+    static const size_t CLASS_COUNT = MAX_SIZE / GRANULE;
+    static const size_t PAGE_SIZE   = 64 * 1024;
+    static const size_t MAX_SPARE   = 16;
+
+    struct alignas(16) Page {
+        Page* next;
+    };
+
+    struct FreeSlot {
+        FreeSlot* next;
+    };
+
+    FreeSlot* free_lists[CLASS_COUNT] = {};
+    Page*     pages = nullptr;
+    char*     cur = nullptr;
+    char*     end = nullptr;
+    PoolStats stats;
+
+    struct SparePages {
+        Page*  list = nullptr;
+        size_t count = 0;
+
+        ~SparePages() {
+            while (list) {
+                Page* next = list->next;
+                std::free(list);
+                list = next;
+            }
+        }
+    };
+
+    static SparePages& spare() {
+        thread_local SparePages pages;
+        return pages;
+    }
+
+    static size_t class_of(size_t size) {
+        return (size + GRANULE - 1) / GRANULE - 1;
+    }
+
+    void new_page() {
+        SparePages& sp = spare();
+        Page* p;
+
+        if (sp.list) {
+            p = sp.list;
+            sp.list = p->next;
+            sp.count--;
+        } else {
+            p = static_cast<Page*>(std::malloc(PAGE_SIZE));
+            if (!p) throw std::bad_alloc();
+        }
+
+        p->next = pages;
+        pages = p;
+        cur = reinterpret_cast<char*>(p + 1);
+        end = reinterpret_cast<char*>(p) + PAGE_SIZE;
+        stats.bytes_reserved += PAGE_SIZE;
+    }
+
+public:
+    Pool() = default;
+
+    ~Pool() {
+        SparePages& sp = spare();
+        while (pages) {
+            Page* next = pages->next;
+            if (sp.count < MAX_SPARE) {
+                pages->next = sp.list;
+                sp.list = pages;
+                sp.count++;
+            } else {
+                std::free(pages);
+            }
+            pages = next;
+        }
+    }
+
+    Pool(const Pool&) = delete;
+    Pool& operator=(const Pool&) = delete;
+
+    void* alloc(size_t size) {
+        if (size > MAX_SIZE) {
+            void* p = std::malloc(size);
+            if (!p) throw std::bad_alloc();
+            return p;
+        }
+
+        size_t c = class_of(size);
+        size_t slot = (c + 1) * GRANULE;
+        stats.bytes_used += slot;
+        stats.allocations++;
+
+        if (FreeSlot* s = free_lists[c]) {
+            free_lists[c] = s->next;
+            return s;
+        }
+
+        // the tail of the previous page, at most MAX_SIZE bytes, is left unused
+        if (static_cast<size_t>(end - cur) < slot) new_page();
+
+        void* p = cur;
+        cur += slot;
+        return p;
+    }
+
+    // size must be the size the block was allocated with
+    void free(void* p, size_t size) {
+        if (size > MAX_SIZE) {
+            std::free(p);
+            return;
+        }
+
+        size_t c = class_of(size);
+        stats.bytes_used -= (c + 1) * GRANULE;
+
+        FreeSlot* s = static_cast<FreeSlot*>(p);
+        s->next = free_lists[c];
+        free_lists[c] = s;
+    }
+
+    const PoolStats& statistics() const { return stats; }
+};
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "module.hpp"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define CVM_TSC 1
+#include <x86intrin.h>
+#endif
+
+// a cheap timestamp for the profiler: the cycle counter on x86, nanoseconds elsewhere
+inline uint64_t profile_ticks() {
+#ifdef CVM_TSC
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+inline const char* profile_tick_unit() {
+#ifdef CVM_TSC
+    return "cycles";
+#else
+    return "ns";
+#endif
+}
+
+// what the vm's profiling loop records: how often each opcode ran, the ticks
+// from its dispatch to the next one's (a collection at the safepoint counts
+// towards the instruction it ran before), and how often one opcode directly
+// followed another, the candidates for superinstructions.
+class OpcodeProfile {
+private:
+    std::array<uint64_t, 256> counts{};
+    std::array<uint64_t, 256> ticks{};
+    std::vector<uint64_t>     pairs = std::vector<uint64_t>(256 * 256);  // first << 8 | second
+
+    int      open = -1;  // the opcode being timed
+    uint64_t since = 0;
+
+public:
+    struct Row {
+        uint8_t  op;
+        uint64_t count;
+        uint64_t ticks;
+    };
+
+    struct Pair {
+        uint8_t  first;
+        uint8_t  second;
+        uint64_t count;
+    };
+
+    // called at every dispatch, ends the previous instruction
+    void enter(uint8_t op, uint64_t now) {
+        if (open >= 0) {
+            ticks[open] += now - since;
+            pairs[(open << 8) | op]++;
+        }
+        counts[op]++;
+        open = op;
+        since = now;
+    }
+
+    // the vm left its loop. the next instruction does not pair with this one
+    void leave(uint64_t now) {
+        if (open >= 0) ticks[open] += now - since;
+        open = -1;
+    }
+
+    uint64_t total_count() const {
+        uint64_t n = 0;
+        for (uint64_t c : counts) n += c;
+        return n;
+    }
+
+    uint64_t total_ticks() const {
+        uint64_t n = 0;
+        for (uint64_t t : ticks) n += t;
+        return n;
+    }
+
+    // every opcode that ran, most time first
+    std::vector<Row> rows() const {
+        std::vector<Row> out;
+        for (size_t op = 0; op < counts.size(); op++) {
+            if (counts[op]) out.push_back({static_cast<uint8_t>(op), counts[op], ticks[op]});
+        }
+        std::sort(out.begin(), out.end(), [](const Row& a, const Row& b) { return a.ticks > b.ticks; });
+        return out;
+    }
+
+    // the n most frequent opcode pairs
+    std::vector<Pair> top_pairs(size_t n) const {
+        std::vector<Pair> out;
+        for (size_t i = 0; i < pairs.size(); i++) {
+            if (pairs[i]) out.push_back({static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i & 0xFF), pairs[i]});
+        }
+        std::sort(out.begin(), out.end(), [](const Pair& a, const Pair& b) { return a.count > b.count; });
+        if (out.size() > n) out.resize(n);
+        return out;
+    }
+};
+
+// samples where a vm spends its time. a ticker thread bumps a counter every
+// interval; the vm's sampling loop notices the change at its next dispatch and
+// records the running task's call stack, weighted by the ticks that passed, so
+// a long collection or native call gets its share of wall time. stacks are kept
+// as raw pcs and only turned into names and lines when they are written out.
+class StackSampler {
+public:
+    static const size_t MAX_DEPTH = 256;  // innermost frames kept per sample
+
+    // a stack key starts with these flags, then the pcs, outermost first
+    static const uint32_t TOP_LEVEL = 1;  // the outermost frame is the module's top level code
+    static const uint32_t TRUNCATED = 2;  // frames beyond MAX_DEPTH were dropped
+
+private:
+    struct KeyHash {
+        size_t operator()(const std::vector<uint32_t>& key) const {
+            return fnv1a(reinterpret_cast<const uint8_t*>(key.data()), key.size() * sizeof(uint32_t));
+        }
+    };
+
+    std::atomic<uint64_t>   ticks{0};
+    std::atomic<bool>       pending{false};  // ticks since the last sample, the one thing the loop reads
+    uint64_t                seen = 0;
+    uint64_t                total = 0;
+    std::unordered_map<std::vector<uint32_t>, uint64_t, KeyHash> stacks;
+
+    std::mutex              lock;
+    std::condition_variable wake;
+    bool                    stopping = false;
+    std::thread             ticker;
+
+public:
+    explicit StackSampler(std::chrono::microseconds interval) {
+        ticker = std::thread([this, interval] {
+            std::unique_lock<std::mutex> guard(lock);
+            while (!wake.wait_for(guard, interval, [this] { return stopping; })) {
+                ticks.fetch_add(1, std::memory_order_relaxed);
+                pending.store(true, std::memory_order_relaxed);
+            }
+        });
+    }
+
+    ~StackSampler() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        ticker.join();
+    }
+
+    StackSampler(const StackSampler&) = delete;
+    StackSampler& operator=(const StackSampler&) = delete;
+
+    // checked at every dispatch of the sampling loop
+    bool due() const { return pending.load(std::memory_order_relaxed); }
+
+    // counts key once for every tick since the last sample
+    void record(const std::vector<uint32_t>& key) {
+        pending.store(false, std::memory_order_relaxed);
+        uint64_t now = ticks.load(std::memory_order_relaxed);
+        uint64_t weight = now - seen;
+        seen = now;
+
+        stacks[key] += weight;
+        total += weight;
+    }
+
+    uint64_t samples() const { return total; }
+
+    // one "outer;...;inner count" line per distinct stack, the folded format
+    // flamegraph.pl and speedscope read. frames are "function:line", the top
+    // level is "main" and the line is left out without debug info.
+    void write_folded(std::ostream& out, const Module& module) const {
+        std::vector<const FunctionInfo*> by_offset;
+        for (const auto& f : module.functions) by_offset.push_back(&f);
+        std::sort(by_offset.begin(), by_offset.end(),
+                  [](const FunctionInfo* a, const FunctionInfo* b) { return a->offset < b->offset; });
+
+        // a function frame's pc is always inside its own body, and bodies never
+        // overlap, so the function is the last one starting at or before it
+        std::unordered_map<uint64_t, std::string> names;
+        auto frame_name = [&](uint32_t pc, bool top_level) -> const std::string& {
+            uint64_t id = (static_cast<uint64_t>(top_level) << 32) | pc;
+            auto it = names.find(id);
+            if (it != names.end()) return it->second;
+
+            std::string name = "main";
+            if (!top_level) {
+                auto f = std::upper_bound(by_offset.begin(), by_offset.end(), pc,
+                                          [](uint32_t p, const FunctionInfo* fi) { return p < fi->offset; });
+                if (f != by_offset.begin()) name = (*(f - 1))->name;
+            }
+
+            SourcePos pos;
+            if (module.lines.lookup(pc, pos)) name += ":" + std::to_string(pos.line);
+            return names.emplace(id, name).first->second;
+        };
+
+        // stacks that differ only in pcs on the same lines fold into one
+        std::unordered_map<std::string, uint64_t> folded;
+        for (const auto& [key, count] : stacks) {
+            std::string line = (key[0] & TRUNCATED) ? "..." : "";
+            for (size_t i = 1; i < key.size(); i++) {
+                if (!line.empty()) line += ";";
+                line += frame_name(key[i], i == 1 && (key[0] & TOP_LEVEL));
+            }
+            folded[line] += count;
+        }
+
+        std::vector<std::pair<std::string, uint64_t>> lines(folded.begin(), folded.end());
+        std::sort(lines.begin(), lines.end());
+        for (const auto& [line, count] : lines) out << line << " " << count << "\n";
+    }
+};
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <memory>
+#include <utility>
+
+#include "module.hpp"
+
+// a compiled module frozen for execution. nothing in it changes after it is
+// built, so one Program can back any number of vms on any number of threads at
+// once. a vm only holds a reference to it, the bytecode is never copied.
+class Program {
+private:
+    Module mod;
+
+public:
+    explicit Program(Module m) : mod(std::move(m)) {}
+
+    Program(const Program&) = delete;
+    Program& operator=(const Program&) = delete;
+
+    const Module& module() const { return mod; }
+};
+
+using ProgramRef = std::shared_ptr<const Program>;
+
+inline ProgramRef make_program(Module module) {
+    return std::make_shared<const Program>(std::move(module));
+}
@@ -0,0 +1,341 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define CVM_X86_KERNELS 1
+#include <immintrin.h>
+#define CVM_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+// kernels over raw int arrays (see BufferObject) used by the array builtins.
+// each one has a scalar version and, on x86, SSE4.1 and AVX2 versions picked
+// once at startup from what the cpu supports. arithmetic wraps like the vm's
+// 32 bit ints, index_of returns n when nothing matches.
+struct ArrayKernels {
+    const char* name;
+
+    int32_t (*sum)(const int32_t* data, size_t n);
+    int32_t (*min)(const int32_t* data, size_t n);  // n > 0
+    int32_t (*max)(const int32_t* data, size_t n);  // n > 0
+    size_t  (*index_of)(const int32_t* data, size_t n, int32_t x);
+    size_t  (*count)(const int32_t* data, size_t n, int32_t x);
+    void    (*fill)(int32_t* data, size_t n, int32_t x);
+    void    (*add)(int32_t* data, size_t n, int32_t x);
+    void    (*mul)(int32_t* data, size_t n, int32_t x);
+    void    (*add_array)(int32_t* data, const int32_t* other, size_t n);
+    void    (*mul_array)(int32_t* data, const int32_t* other, size_t n);
+};
+
+namespace scalar_kernels {
+
+inline int32_t wrap(uint32_t v) {
+    int32_t r;
+    std::memcpy(&r, &v, sizeof(r));
+    return r;
+}
+
+inline int32_t sum(const int32_t* data, size_t n) {
+    uint32_t s = 0;
+    for (size_t i = 0; i < n; i++) s += static_cast<uint32_t>(data[i]);
+    return wrap(s);
+}
+
+inline int32_t min(const int32_t* data, size_t n) {
+    int32_t m = data[0];
+    for (size_t i = 1; i < n; i++) m = data[i] < m ? data[i] : m;
+    return m;
+}
+
+inline int32_t max(const int32_t* data, size_t n) {
+    int32_t m = data[0];
+    for (size_t i = 1; i < n; i++) m = data[i] > m ? data[i] : m;
+    return m;
+}
+
+inline size_t index_of(const int32_t* data, size_t n, int32_t x) {
+    for (size_t i = 0; i < n; i++) {
+        if (data[i] == x) return i;
+    }
+    return n;
+}
+
+inline size_t count(const int32_t* data, size_t n, int32_t x) {
+    size_t c = 0;
+    for (size_t i = 0; i < n; i++) c += data[i] == x;
+    return c;
+}
+
+inline void fill(int32_t* data, size_t n, int32_t x) {
+    for (size_t i = 0; i < n; i++) data[i] = x;
+}
+
+inline void add(int32_t* data, size_t n, int32_t x) {
+    for (size_t i = 0; i < n; i++) data[i] = wrap(static_cast<uint32_t>(data[i]) + static_cast<uint32_t>(x));
+}
+
+inline void mul(int32_t* data, size_t n, int32_t x) {
+    for (size_t i = 0; i < n; i++) data[i] = wrap(static_cast<uint32_t>(data[i]) * static_cast<uint32_t>(x));
+}
+
+inline void add_array(int32_t* data, const int32_t* other, size_t n) {
+    for (size_t i = 0; i < n; i++) data[i] = wrap(static_cast<uint32_t>(data[i]) + static_cast<uint32_t>(other[i]));
+}
+
+inline void mul_array(int32_t* data, const int32_t* other, size_t n) {
+    for (size_t i = 0; i < n; i++) data[i] = wrap(static_cast<uint32_t>(data[i]) * static_cast<uint32_t>(other[i]));
+}
+
+}  // namespace scalar_kernels
+
+#ifdef CVM_X86_KERNELS
+
+namespace sse_kernels {
+
+CVM_TARGET("sse4.1") inline __m128i load(const int32_t* p) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+CVM_TARGET("sse4.1") inline void store(int32_t* p, __m128i v) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v);
+}
+
+CVM_TARGET("sse4.1") inline int32_t sum(const int32_t* data, size_t n) {
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) acc = _mm_add_epi32(acc, load(data + i));
+
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4E));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xB1));
+    int32_t s = _mm_cvtsi128_si32(acc);
+    return scalar_kernels::wrap(static_cast<uint32_t>(s) + static_cast<uint32_t>(scalar_kernels::sum(data + i, n - i)));
+}
+
+CVM_TARGET("sse4.1") inline int32_t min(const int32_t* data, size_t n) {
+    if (n < 4) return scalar_kernels::min(data, n);
+
+    __m128i m = load(data);
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4) m = _mm_min_epi32(m, load(data + i));
+
+    m = _mm_min_epi32(m, _mm_shuffle_epi32(m, 0x4E));
+    m = _mm_min_epi32(m, _mm_shuffle_epi32(m, 0xB1));
+    int32_t r = _mm_cvtsi128_si32(m);
+    for (; i < n; i++) r = data[i] < r ? data[i] : r;
+    return r;
+}
+
+CVM_TARGET("sse4.1") inline int32_t max(const int32_t* data, size_t n) {
+    if (n < 4) return scalar_kernels::max(data, n);
+
+    __m128i m = load(data);
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4) m = _mm_max_epi32(m, load(data + i));
+
+    m = _mm_max_epi32(m, _mm_shuffle_epi32(m, 0x4E));
+    m = _mm_max_epi32(m, _mm_shuffle_epi32(m, 0xB1));
+    int32_t r = _mm_cvtsi128_si32(m);
+    for (; i < n; i++) r = data[i] > r ? data[i] : r;
+    return r;
+}
+
+CVM_TARGET("sse4.1") inline size_t index_of(const int32_t* data, size_t n, int32_t x) {
+    __m128i needle = _mm_set1_epi32(x);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(load(data + i), needle)));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + scalar_kernels::index_of(data + i, n - i, x);
+}
+
+CVM_TARGET("sse4.1") inline size_t count(const int32_t* data, size_t n, int32_t x) {
+    // matches compare to -1, so subtracting them counts per lane
+    __m128i needle = _mm_set1_epi32(x);
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) acc = _mm_sub_epi32(acc, _mm_cmpeq_epi32(load(data + i), needle));
+
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4E));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xB1));
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(acc)) + scalar_kernels::count(data + i, n - i, x);
+}
+
+CVM_TARGET("sse4.1") inline void fill(int32_t* data, size_t n, int32_t x) {
+    __m128i v = _mm_set1_epi32(x);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) store(data + i, v);
+    scalar_kernels::fill(data + i, n - i, x);
+}
+
+CVM_TARGET("sse4.1") inline void add(int32_t* data, size_t n, int32_t x) {
+    __m128i v = _mm_set1_epi32(x);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) store(data + i, _mm_add_epi32(load(data + i), v));
+    scalar_kernels::add(data + i, n - i, x);
+}
+
+CVM_TARGET("sse4.1") inline void mul(int32_t* data, size_t n, int32_t x) {
+    __m128i v = _mm_set1_epi32(x);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) store(data + i, _mm_mullo_epi32(load(data + i), v));
+    scalar_kernels::mul(data + i, n - i, x);
+}
+
+CVM_TARGET("sse4.1") inline void add_array(int32_t* data, const int32_t* other, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) store(data + i, _mm_add_epi32(load(data + i), load(other + i)));
+    scalar_kernels::add_array(data + i, other + i, n - i);
+}
+
+CVM_TARGET("sse4.1") inline void mul_array(int32_t* data, const int32_t* other, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) store(data + i, _mm_mullo_epi32(load(data + i), load(other + i)));
+    scalar_kernels::mul_array(data + i, other + i, n - i);
+}
+
+}  // namespace sse_kernels
+
+namespace avx2_kernels {
+
+CVM_TARGET("avx2") inline __m256i load(const int32_t* p) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+}
+
+CVM_TARGET("avx2") inline void store(int32_t* p, __m256i v) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v);
+}
+
+CVM_TARGET("avx2") inline int32_t sum(const int32_t* data, size_t n) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) acc = _mm256_add_epi32(acc, load(data + i));
+
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4E));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xB1));
+    int32_t r = _mm_cvtsi128_si32(s);
+    return scalar_kernels::wrap(static_cast<uint32_t>(r) + static_cast<uint32_t>(scalar_kernels::sum(data + i, n - i)));
+}
+
+CVM_TARGET("avx2") inline int32_t min(const int32_t* data, size_t n) {
+    if (n < 8) return scalar_kernels::min(data, n);
+
+    __m256i m = load(data);
+    size_t i = 8;
+    for (; i + 8 <= n; i += 8) m = _mm256_min_epi32(m, load(data + i));
+
+    __m128i h = _mm_min_epi32(_mm256_castsi256_si128(m), _mm256_extracti128_si256(m, 1));
+    h = _mm_min_epi32(h, _mm_shuffle_epi32(h, 0x4E));
+    h = _mm_min_epi32(h, _mm_shuffle_epi32(h, 0xB1));
+    int32_t r = _mm_cvtsi128_si32(h);
+    for (; i < n; i++) r = data[i] < r ? data[i] : r;
+    return r;
+}
+
+CVM_TARGET("avx2") inline int32_t max(const int32_t* data, size_t n) {
+    if (n < 8) return scalar_kernels::max(data, n);
+
+    __m256i m = load(data);
+    size_t i = 8;
+    for (; i + 8 <= n; i += 8) m = _mm256_max_epi32(m, load(data + i));
+
+    __m128i h = _mm_max_epi32(_mm256_castsi256_si128(m), _mm256_extracti128_si256(m, 1));
+    h = _mm_max_epi32(h, _mm_shuffle_epi32(h, 0x4E));
+    h = _mm_max_epi32(h, _mm_shuffle_epi32(h, 0xB1));
+    int32_t r = _mm_cvtsi128_si32(h);
+    for (; i < n; i++) r = data[i] > r ? data[i] : r;
+    return r;
+}
+
+CVM_TARGET("avx2") inline size_t index_of(const int32_t* data, size_t n, int32_t x) {
+    __m256i needle = _mm256_set1_epi32(x);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(load(data + i), needle)));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + scalar_kernels::index_of(data + i, n - i, x);
+}
+
+CVM_TARGET("avx2") inline size_t count(const int32_t* data, size_t n, int32_t x) {
+    __m256i needle = _mm256_set1_epi32(x);
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) acc = _mm256_sub_epi32(acc, _mm256_cmpeq_epi32(load(data + i), needle));
+
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4E));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xB1));
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(s)) + scalar_kernels::count(data + i, n - i, x);
+}
+
+CVM_TARGET("avx2") inline void fill(int32_t* data, size_t n, int32_t x) {
+    __m256i v = _mm256_set1_epi32(x);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) store(data + i, v);
+    scalar_kernels::fill(data + i, n - i, x);
+}
+
+CVM_TARGET("avx2") inline void add(int32_t* data, size_t n, int32_t x) {
+    __m256i v = _mm256_set1_epi32(x);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) store(data + i, _mm256_add_epi32(load(data + i), v));
+    scalar_kernels::add(data + i, n - i, x);
+}
+
+CVM_TARGET("avx2") inline void mul(int32_t* data, size_t n, int32_t x) {
+    __m256i v = _mm256_set1_epi32(x);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) store(data + i, _mm256_mullo_epi32(load(data + i), v));
+    scalar_kernels::mul(data + i, n - i, x);
+}
+
+CVM_TARGET("avx2") inline void add_array(int32_t* data, const int32_t* other, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) store(data + i, _mm256_add_epi32(load(data + i), load(other + i)));
+    scalar_kernels::add_array(data + i, other + i, n - i);
+}
+
+CVM_TARGET("avx2") inline void mul_array(int32_t* data, const int32_t* other, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) store(data + i, _mm256_mullo_epi32(load(data + i), load(other + i)));
+    scalar_kernels::mul_array(data + i, other + i, n - i);
+}
+
+}  // namespace avx2_kernels
+
+#endif
+
+#define CVM_KERNELS(ns, label) \
+    ArrayKernels{label, ns::sum, ns::min, ns::max, ns::index_of, ns::count, \
+                 ns::fill, ns::add, ns::mul, ns::add_array, ns::mul_array}
+
+// the best kernels this cpu runs. CVM_SIMD=scalar|sse4.1|avx2 caps the choice,
+// which is handy for comparing them.
+inline ArrayKernels detect_kernels() {
+    const char* cap = std::getenv("CVM_SIMD");
+    auto allowed = [cap](const char* name) {
+        if (!cap || !*cap) return true;
+        if (std::strcmp(cap, "scalar") == 0) return false;
+        if (std::strcmp(cap, "sse4.1") == 0) return std::strcmp(name, "sse4.1") == 0;
+        return true;
+    };
+
+#ifdef CVM_X86_KERNELS
+    __builtin_cpu_init();
+    if (allowed("avx2") && __builtin_cpu_supports("avx2")) return CVM_KERNELS(avx2_kernels, "avx2");
+    if (allowed("sse4.1") && __builtin_cpu_supports("sse4.1")) return CVM_KERNELS(sse_kernels, "sse4.1");
+#else
+    (void)allowed;
+#endif
+    return CVM_KERNELS(scalar_kernels, "scalar");
+}
+
+inline const ArrayKernels& array_kernels() {
+    static const ArrayKernels kernels = detect_kernels();
+    return kernels;
+}
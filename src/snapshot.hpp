@@ -0,0 +1,193 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "module.hpp"
+
+// vm snapshot (.cats) format, all integers little endian:
+//
+//   magic        "CATS"
+//   version      u16
+//   module       u32 len, a complete .catc module (see module.hpp)
+//   strings      u32 count, then { u8 interned, u32 len, bytes }
+//   arrays       u32 count, then { u8 element type, u32 length, elements }
+//                elements are i32 for int, u8 for bool and a u32 string index
+//                (SNAPSHOT_NULL for an unset slot) for string
+//   tasks        u32 count, u32 running task, then per task in id order:
+//                { u8 state, u32 floor, u32 n, value[n], u32 n, { u32 ip, u32 base, u32 locals }[n],
+//                  value result, u32 len, error, u32 n, u32 joiner ids[n] }
+//   run queue    u32 count, u32 task ids
+//   checksum     u64     fnv1a of everything above
+//
+// a value is a u8 type followed by an i32 for int, a u8 for bool and a u32
+// string or array index for heap values. strings and arrays are numbered
+// separately, in the order they appear in their section.
+
+static const char     SNAPSHOT_MAGIC[4] = {'C', 'A', 'T', 'S'};
+static const uint16_t SNAPSHOT_VERSION  = 1;
+static const uint32_t SNAPSHOT_NULL     = 0xFFFFFFFF;
+
+class SnapshotWriter {
+private:
+    std::vector<uint8_t> out;
+
+public:
+    void u8(uint8_t v) { out.push_back(v); }
+
+    void u16(uint16_t v) {
+        u8(v & 0xFF);
+        u8((v >> 8) & 0xFF);
+    }
+
+    void u32(uint32_t v) {
+        for (int i = 0; i < 4; i++) u8((v >> (i * 8)) & 0xFF);
+    }
+
+    void u64(uint64_t v) {
+        for (int i = 0; i < 8; i++) u8((v >> (i * 8)) & 0xFF);
+    }
+
+    void bytes(const void* data, size_t len) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        out.insert(out.end(), p, p + len);
+    }
+
+    // sizes are stored as u32, bigger ones cannot be encoded
+    void size(size_t v) {
+        if (v > UINT32_MAX) throw std::runtime_error("Snapshot too large.");
+        u32(static_cast<uint32_t>(v));
+    }
+
+    // appends the checksum and hands back the finished snapshot
+    std::vector<uint8_t> finish() {
+        u64(fnv1a(out.data(), out.size()));
+        return std::move(out);
+    }
+};
+
+class SnapshotReader {
+private:
+    const uint8_t* in;
+    size_t         len;
+    size_t         pos = 0;
+
+public:
+    SnapshotReader(const uint8_t* data, size_t size) : in(data), len(size) {}
+
+    static bool is_snapshot(const uint8_t* data, size_t size) {
+        return size >= sizeof(SNAPSHOT_MAGIC) && std::memcmp(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0;
+    }
+
+    // checks the magic, version and checksum, leaves the reader at the module
+    void open() {
+        if (!is_snapshot(in, len)) {
+            throw std::runtime_error("Not a cvm snapshot.");
+        }
+
+        uint64_t checksum = 0;
+        if (len >= 8) {
+            for (int i = 0; i < 8; i++) checksum |= static_cast<uint64_t>(in[len - 8 + i]) << (i * 8);
+        }
+        if (len < 8 || fnv1a(in, len - 8) != checksum) {
+            throw std::runtime_error("Snapshot checksum mismatch.");
+        }
+
+        len -= 8;
+        pos = sizeof(SNAPSHOT_MAGIC);
+        uint16_t version = u16();
+        if (version != SNAPSHOT_VERSION) {
+            throw std::runtime_error("Unsupported snapshot version " + std::to_string(version) + ".");
+        }
+    }
+
+    void need(size_t n) const {
+        if (len - pos < n) {
+            throw std::runtime_error("Truncated snapshot.");
+        }
+    }
+
+    uint8_t u8() {
+        need(1);
+        return in[pos++];
+    }
+
+    uint16_t u16() {
+        uint16_t v = u8();
+        return v | (u8() << 8);
+    }
+
+    uint32_t u32() {
+        need(4);
+        uint32_t v = 0;
+        for (int i = 0; i < 4; i++) v |= static_cast<uint32_t>(in[pos++]) << (i * 8);
+        return v;
+    }
+
+    // a view into the snapshot itself, nothing is copied
+    std::string_view bytes(size_t n) {
+        need(n);
+        std::string_view v(reinterpret_cast<const char*>(in + pos), n);
+        pos += n;
+        return v;
+    }
+
+    Type type() {
+        uint8_t t = u8();
+        if (t > static_cast<uint8_t>(Type::VOID)) {
+            throw std::runtime_error("Invalid type in snapshot.");
+        }
+        return static_cast<Type>(t);
+    }
+
+    bool at_end() const { return pos == len; }
+};
+
+// a read only mapping of a whole file, snapshots are restored straight from it
+class MappedFile {
+private:
+    const uint8_t* base = nullptr;
+    size_t         length = 0;
+
+public:
+    explicit MappedFile(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error("could not open file '" + path + "'");
+        }
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            throw std::runtime_error("could not map file '" + path + "'");
+        }
+
+        void* p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("could not map file '" + path + "'");
+        }
+
+        base = static_cast<const uint8_t*>(p);
+        length = static_cast<size_t>(st.st_size);
+    }
+
+    ~MappedFile() {
+        if (base) ::munmap(const_cast<uint8_t*>(base), length);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* data() const { return base; }
+    size_t size() const { return length; }
+};
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+
+#include "ctypes.hpp"
+#include "heap.hpp"
+
+// concatenations shorter than this are copied into a flat string, longer ones
+// become rope nodes so that building a string piece by piece stays linear.
+static const size_t ROPE_MIN_LENGTH = 64;
+
+// number of characters std::to_chars writes for v
+inline size_t int_length(int v) {
+    uint32_t u = v < 0 ? 0u - static_cast<uint32_t>(v) : static_cast<uint32_t>(v);
+    size_t n = v < 0 ? 2 : 1;
+    while (u >= 10) {
+        u /= 10;
+        n++;
+    }
+    return n;
+}
+
+inline void copy_chars(const StringObject* s, char* dst) {
+    each_piece(s, [&](std::string_view piece) {
+        std::memcpy(dst, piece.data(), piece.size());
+        dst += piece.size();
+    });
+}
+
+// length of v when converted for concatenation
+inline size_t text_length(const Value& v) {
+    switch (v.type) {
+        case Type::STRING: return v.svalue->length;
+        case Type::INT:    return int_length(v.ivalue);
+        case Type::BOOL:   return v.bvalue ? 4 : 5;
+        default: throw std::runtime_error("Cannot concatenate non-scalar value.");
+    }
+}
+
+// writes the text of v straight into dst, returns the end
+inline char* write_text(const Value& v, char* dst) {
+    switch (v.type) {
+        case Type::STRING:
+            copy_chars(v.svalue, dst);
+            return dst + v.svalue->length;
+        case Type::INT:
+            return std::to_chars(dst, dst + 11, v.ivalue).ptr;
+        case Type::BOOL: {
+            const char* text = v.bvalue ? "true" : "false";
+            size_t n = v.bvalue ? 4 : 5;
+            std::memcpy(dst, text, n);
+            return dst + n;
+        }
+        default:
+            return dst;
+    }
+}
+
+inline StringObject* to_string_object(Heap& heap, const Value& v) {
+    if (v.type == Type::STRING) return v.svalue;
+
+    StringObject* s = heap.make_string(text_length(v));
+    write_text(v, s->chars());
+    return s;
+}
+
+// O(1) for long strings: either operand may be shared, neither is copied
+inline StringObject* concat(Heap& heap, const Value& a, const Value& b) {
+    size_t a_len = text_length(a);
+    size_t b_len = text_length(b);
+    size_t length = a_len + b_len;
+
+    if (length > UINT32_MAX) {
+        throw std::runtime_error("String too long.");
+    }
+
+    if (b_len == 0 && a.type == Type::STRING) return a.svalue;
+    if (a_len == 0 && b.type == Type::STRING) return b.svalue;
+
+    if (length < ROPE_MIN_LENGTH) {
+        if (length <= heap.intern_limit()) {
+            char buf[ROPE_MIN_LENGTH];
+            write_text(b, write_text(a, buf));
+            return heap.intern(std::string_view(buf, length));
+        }
+
+        StringObject* s = heap.make_string(length);
+        write_text(b, write_text(a, s->chars()));
+        return s;
+    }
+
+    StringObject* left = to_string_object(heap, a);
+    StringObject* right = to_string_object(heap, b);
+    return heap.make_rope(left, right);
+}
+
+// returns a flat string with the same contents. a flattened rope keeps the flat
+// copy so later reads don't pay for it again.
+inline StringObject* flatten(Heap& heap, StringObject* s) {
+    if (s->is_flat()) return s;
+
+    RopeObject* r = static_cast<RopeObject*>(s);
+    if (!r->right) return r->left;
+
+    StringObject* flat = heap.make_string(s->length);
+    copy_chars(s, flat->chars());
+
+    r->left = flat;
+    r->right = nullptr;
+    heap.write_barrier(r, flat);
+    return flat;
+}
+
+// cached on the string (and on the flattened copy of a rope)
+inline uint32_t string_hash(Heap& heap, StringObject* s) {
+    if (s->hash) return s->hash;
+
+    StringObject* flat = flatten(heap, s);
+    if (!flat->hash) flat->hash = hash_string(flat->view());
+    s->hash = flat->hash;
+    return s->hash;
+}
+
+// interned strings are unique, so two of them are equal only if they are the
+// same object. against an interned string the other side's hash is computed once
+// and cached, which makes repeated compares against literals O(1) on mismatch.
+inline bool string_equals(Heap& heap, StringObject* a, StringObject* b) {
+    if (a == b) return true;
+    if (a->length != b->length) return false;
+    if (a->flags & b->flags & OBJ_INTERNED) return false;
+
+    if ((a->hash && b->hash) || ((a->flags | b->flags) & OBJ_INTERNED)) {
+        if (string_hash(heap, a) != string_hash(heap, b)) return false;
+    }
+
+    return flatten(heap, a)->view() == flatten(heap, b)->view();
+}
+
+// the frozen form of s with a reference for the caller. strings that are
+// already frozen are shared, not copied.
+inline StringObject* freeze(Heap& heap, StringObject* s) {
+    if (s->flags & OBJ_FROZEN) {
+        retain_frozen(s);
+        return s;
+    }
+    return freeze_string(flatten(heap, s)->view());
+}